@@ -12,6 +12,10 @@ http://www.gnu.org/licenses/gpl.txt for license details.
 #include <getopt.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <linux/errqueue.h>
+#include <poll.h>
 #include <netdb.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -23,8 +27,27 @@ http://www.gnu.org/licenses/gpl.txt for license details.
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/uio.h>
+#include <sys/ioctl.h>
+#include <linux/sockios.h>
+#include <sys/resource.h>
+#include <signal.h>
 #include <semaphore.h>
+#include <pthread.h>
 #include "cprefresh.h"
+#include "looprec.h"
+#include "ctlpage.h"
+#include "fanout.h"
+#include "frame.h"
+#include "feedback.h"
+#include "uring.h"
+#include "mcast.h"
+#include "hist.h"
+#include "pacing.h"
+#include "crc32c.h"
+#include "clocksync.h"
+#include "tstamp.h"
 
 /* help page */
 /* vim hint to remove resp. add quotes:
@@ -70,10 +93,158 @@ void usage( ) {
 "\n"
 "  --port-to-write=intval, -p intval\n"
 "      the network port number to which data are written instead of stdout.\n"
+"      For a receiver on the same machine a local (unix domain) socket\n"
+"      can be used instead, this is cheaper than TCP on the loopback\n"
+"      device: 'unix:/path' creates a socket in the file system (an old\n"
+"      socket of that name is removed), 'unix:@name' one in the abstract\n"
+"      namespace. The receiving program uses the same string as host\n"
+"      name. Not possible with --kernel-pacing.\n"
+"\n"
+"  --max-clients=intval, -N intval\n"
+"      with --port-to-write, serve up to intval clients (e.g., players in\n"
+"      several rooms) from the same timed loop. The program waits for\n"
+"      the first client, further clients can connect at any time and\n"
+"      get the data from the current position on. The data written per\n"
+"      loop are stored once in a ring buffer and sent to each client\n"
+"      without blocking. Default is 1, a single client to which we write\n"
+"      directly.\n"
+"\n"
+"  --client-backlog=intval, -B intval\n"
+"      with --max-clients larger than 1, the size of the ring buffer in\n"
+"      bytes, this is the amount of data a client can lag behind.\n"
+"      Default is the --buffer-size.\n"
+"\n"
+"  --slow-clients=resync|drop, -W resync|drop\n"
+"      what to do with a client that lags more than --client-backlog\n"
+"      behind: 'resync' skips to the newest data for this client (the\n"
+"      default), 'drop' closes its connection. The other clients are\n"
+"      not affected.\n"
+"\n"
+"  --multicast=group:port[:interface], -A group:port[:interface]\n"
+"      send the output as UDP multicast to this group (e.g.,\n"
+"      239.255.77.1:5888), instead of stdout or --port-to-write. The data\n"
+"      are cut into packets of 1440 bytes with sequence numbers, the\n"
+"      packets of one loop are sent with a single system call and are\n"
+"      not resent. Any number of 'playhrt' programs (with the same\n"
+"      --multicast option) can receive the stream and join at any time,\n"
+"      the cost for the sender does not depend on their number. The\n"
+"      optional interface is the local address of the network interface\n"
+"      to use, 127.0.0.1 for receivers on the same machine. Packets are\n"
+"      not routed (TTL 1), a rest of less than a packet is sent with the\n"
+"      next loop. Not possible with --outfile, --zero-copy or --feedback.\n"
+"\n"
+"  --clock-master=port\n"
+"      with --multicast, answer timestamp requests of 'playhrt' programs\n"
+"      (option --clock-sync) on this UDP port. So, several players\n"
+"      in different rooms share the clock of this program, and they\n"
+"      write each part of the stream at the same time (a fixed delay\n"
+"      after it was sent). The answers also contain the number of bytes\n"
+"      sent up to the current loop. The requests are answered by a\n"
+"      separate thread, the timed loop is not disturbed.\n"
+"\n"
+"  --clock-offset=intval[:floatval]\n"
+"      for tests of --clock-master on a single machine: add intval\n"
+"      nanoseconds and a rate difference of floatval ppm to the clock\n"
+"      used for the shared timeline.\n"
+"\n"
+"  --framed=mono|tai, -E mono|tai\n"
+"      with --port-to-write, each chunk is sent with a small header\n"
+"      containing a sequence number and a timestamp (see src/frame.h).\n"
+"      The receiving 'playhrt' must use its option --framed as well, it\n"
+"      then reports the latency and jitter of the chunks and gaps in the\n"
+"      stream. With 'mono' the timestamp is from CLOCK_MONOTONIC, this is\n"
+"      only useful if both programs run on the same machine. With 'tai'\n"
+"      CLOCK_TAI is used, the clocks of both machines must be synchronized\n"
+"      (e.g., with PTP). Not possible with --zero-copy or --max-clients.\n"
+"\n"
+"  --feedback=net|/name, -Q net|/name\n"
+"      adjust the speed of the output to reports of the receiving\n"
+"      'playhrt' about the fill of its buffers (in default and shared\n"
+"      memory mode). With 'net' the reports are read from the network\n"
+"      connection, 'playhrt' must be called with --feedback. If both\n"
+"      programs run on the same machine, the name of the --control-shm\n"
+"      page of 'playhrt' can be given instead. After a few seconds the\n"
+"      current fill is taken as target; then --extra-bytes-per-second\n"
+"      is changed continuously (at most by 1%% of --bytes-per-second)\n"
+"      such that the fill returns to the target within some ten seconds\n"
+"      and stays there. So, no calibration of\n"
+"      --extra-bytes-per-second is needed and small network buffers can\n"
+"      be used.\n"
+"\n"
+"  --kernel-pacing, -J\n"
+"      with --port-to-write, let the kernel pace the data on the network\n"
+"      socket (socket option SO_MAX_PACING_RATE, works with TCP internal\n"
+"      pacing or the 'fq' queueing discipline). The rate is set 4%% above\n"
+"      --bytes-per-second (plus --extra-bytes-per-second) to cover the\n"
+"      protocol headers. The loop should then write larger chunks less\n"
+"      often, e.g., use --loops-per-second=50; this needs less CPU and\n"
+"      fewer wakeups while the kernel spreads the packets evenly.\n"
+"      Without --out-net-buffer-size the send buffer is set to the data\n"
+"      of about 0.1 seconds. With --max-clients each client socket is\n"
+"      paced at this rate.\n"
+"\n"
+"  --notsent-lowat=intval, -l intval\n"
+"      with --port-to-write (TCP), at most intval bytes which are not yet\n"
+"      sent are kept in the socket (TCP_NOTSENT_LOWAT), a write blocks\n"
+"      until the queue is below this limit. So, if the network or the\n"
+"      receiver is slow this shows up in the timed loop (see\n"
+"      --send-stats) instead of being hidden in a large socket buffer.\n"
+"      Something like two or three times the data per loop is sensible.\n"
+"\n"
+"  --nodelay, -y\n"
+"      with --port-to-write (TCP), send each chunk immediately, without\n"
+"      waiting to fill a network packet (TCP_NODELAY).\n"
+"\n"
+"  --msg-zerocopy=intval, -z intval\n"
+"      with --port-to-write (TCP), chunks of at least intval bytes are\n"
+"      sent with MSG_ZEROCOPY: the kernel sends directly from the buffer\n"
+"      of the program, instead of copying the data. The completions are\n"
+"      collected, a part of the buffer is only reused after the kernel\n"
+"      has finished with it. This is only useful for larger chunks\n"
+"      (e.g., 16384 bytes or more, fewer --loops-per-second or interval\n"
+"      mode), on the loopback device the kernel copies anyway. Not\n"
+"      possible with --shared input.\n"
+"\n"
+"  --send-stats, -X\n"
+"      measure in each loop the time of the write call and (with a\n"
+"      network socket) the bytes queued in the socket, not yet sent and\n"
+"      not yet acknowledged. With --verbose a histogram of the write\n"
+"      times and the average and maximal queues are shown at the end.\n"
+"\n"
+"  --tx-timestamps\n"
+"      with --port-to-write (a single client) or --multicast: the kernel\n"
+"      reports when the data of each write are handed to the network\n"
+"      driver (SO_TIMESTAMPING, software timestamps). With --verbose\n"
+"      histograms of the time from the write call to the driver and of\n"
+"      its change from write to write are shown at the end, so the\n"
+"      timing on the wire can be compared for different socket buffer\n"
+"      sizes and loop options (see 'playhrt --rx-timestamps' for the\n"
+"      receiving side).\n"
+"\n"
+"  --keep-listening, -k\n"
+"      with --port-to-write and a single client: if the connection to\n"
+"      the client is lost, the program does not exit but waits for a\n"
+"      new connection and continues with the data from the position\n"
+"      where the old connection stopped (the timed loop starts anew).\n"
+"      So, a player can reconnect after a network problem or a restart\n"
+"      without restarting the whole pipeline (data which were still in\n"
+"      the network buffers of a lost connection are not sent again).\n"
+"      Connections and lost connections are reported with --verbose\n"
+"      and counted in the statistics of --control-shm.\n"
 "\n"
 "  --outfile=fname, -o fname\n"
 "      write to this file instead of stdout.\n"
 "\n"
+"  --verify\n"
+"      with --outfile, compute a CRC32C checksum of all data read and of\n"
+"      all data written (in the same pass), and at the end read the\n"
+"      output file once more from the disk (an existing longer file is\n"
+"      cut to the length written). The program fails (exit\n"
+"      code 34) if the three checksums or lengths are not the same,\n"
+"      i.e., if the copy is not bit-identical. The CRC instructions of\n"
+"      the CPU are used if available. Not possible with --shared or\n"
+"      --zero-copy.\n"
+"\n"
 "  --bytes-per-second=intval, -m intval\n"
 "      the number of bytes to be written to the output per second.\n"
 "      (Alternatively, in case of stereo audio data, the options\n"
@@ -95,7 +266,8 @@ void usage( ) {
 "  --host-to-read=hname, -H hname\n"
 "      the name or ip-address of a machine. If given, you have to specify\n"
 "      --port-to-read as well. In this case data are not read from stdin\n"
-"      but from this host and port.\n"
+"      but from this host and port. A local socket 'unix:/path' or\n"
+"      'unix:@name' (see --port-to-write) needs no --port-to-read.\n"
 "\n"
 "  --port-to-read=intval, -P intval\n"
 "      a port number, see --host-to-read.\n"
@@ -116,11 +288,30 @@ void usage( ) {
 "      several memory files as output in one loop. Therefore,\n"
 "      'writeloop' should be used with a '--file-size' parameter\n"
 "      which is a multiple of the output per loop of 'bufhrt'.\n"
+"      As soon as 'writeloop' has filled the next memory file, it is\n"
+"      taken and refreshed piece by piece in the loops of the current\n"
+"      one, so that usually there is no waiting and no bulk refresh\n"
+"      at the change to the next file. With --verbose the time spent\n"
+"      waiting for 'writeloop' and the number of loops delayed by this\n"
+"      are shown.\n"
+"\n"
+"  --release-batch=intval\n"
+"      with --shared input, give the memory files back to 'writeloop'\n"
+"      in batches of intval files (smaller than the number of files),\n"
+"      such that 'writeloop' wakes up less often and refills several\n"
+"      files in one go. Default is 1.\n"
 "\n"
 "  --input-size=intval, -i intval\n"
 "      the number of bytes to be read per loop (when needed). The default\n"
 "      is to use the smallest amount needed for the output.\n"
 "\n"
+"  --loops-per-read=intval, -R intval\n"
+"      in the default mode input is only read in every intval-th loop,\n"
+"      with correspondingly larger chunks (unless --input-size is even\n"
+"      larger). The reads are done in the time between writing and the\n"
+"      next sleep, the output timing is not changed. With many loops per\n"
+"      second this reduces the number of read calls a lot. Default is 1.\n"
+"\n"
 "  --extra-bytes-per-second=floatval, -e floatval\n"
 "      sometimes the clocks in the sending machine and the receiving\n"
 "      machine are not absolutely synchronous. This option allows\n"
@@ -128,12 +319,57 @@ void usage( ) {
 "      per second (negativ for fewer and positive for more bytes).\n"
 "      The program adjusts the duration of the read-sleep-write rounds.\n"
 "\n"
+"  --catch-up=intval\n"
+"      in the default mode, bytes which could not be written in time\n"
+"      (because the input stalled, a blocking read or write took longer\n"
+"      than a loop, or a write was short) are not lost but written\n"
+"      later, with at most --catch-up-rate more bytes per second, such\n"
+"      that a player does not slowly run out of data after short\n"
+"      stalls. intval is the window in milliseconds: a debt larger than\n"
+"      can be repaid within this time is dropped. After a stall the\n"
+"      loop continues from the current time (without catch-up missed\n"
+"      loops are run immediately one after the other). With --verbose\n"
+"      the debt accrued, repaid and dropped is shown at the end.\n"
+"\n"
+"  --catch-up-rate=floatval\n"
+"      with --catch-up, the maximal extra output while catching up, in\n"
+"      percent of --bytes-per-second. Default is 5.\n"
+"\n"
+"  --zero-copy, -Z\n"
+"      in the default mode with input from a --file, the data are not\n"
+"      read into the buffer of the program but moved with 'sendfile' from\n"
+"      the page cache to the output socket or file, in the same timed\n"
+"      chunks. There is no refreshing of the data in this mode, it is\n"
+"      meant for archival copies and transfers where the timing but not\n"
+"      the refresh passes matter and CPU usage should be low. With\n"
+"      --verbose the CPU time used and the throughput are shown (also\n"
+"      in the normal default mode, for comparison). Not possible with\n"
+"      --max-clients.\n"
+"\n"
+"  --io-uring=intval, -D intval\n"
+"      read an input --file and/or write an --outfile (regular files\n"
+"      only) with io_uring: intval blocks (of 64kB or the size of the\n"
+"      input chunks, if larger) are kept in flight, the timed loop only\n"
+"      copies data from or to completed blocks and submits new requests\n"
+"      without waiting for the disk. If the file system supports it the\n"
+"      files use O_DIRECT (bypassing the page cache), the space of the\n"
+"      output file is allocated in advance. Needs Linux 5.6 or newer.\n"
+"      A sensible value is 4 to 16. Not possible with --zero-copy.\n"
+"\n"
 "  --interval, -I\n"
 "      use interval mode, typically together with a large --buffer-size.\n"
 "      Per interval the buffer is filled without writing data, and then\n"
 "      the buffer content is written out in a sleep-write loop (without\n"
 "      reading input). See below for an example.\n"
 "\n"
+"  --interval-buffers=intval, -G intval\n"
+"      in interval mode use intval buffers of --buffer-size bytes each\n"
+"      (at least 2). A separate thread reads the input into the next\n"
+"      free buffer while the timed loop writes out the current one, so\n"
+"      the total time is about the maximum, instead of the sum, of the\n"
+"      reading and the writing time. Default is 1 (no thread). Only\n"
+"      possible with --interval.\n"
+"\n"
 "  --in-net-buffer-size=intval, -K intval\n"
 "  --out-net-buffer-size=intval, -L intval\n"
 "      this if for finetuning only. It specifies the buffer size to\n"
@@ -142,8 +378,32 @@ void usage( ) {
 "      the program is running can be checked with 'netstat -tpn'.\n"
 "      Usually the operation system chooses sensible values itself.\n"
 "\n"
+"  --record-file=fname, -T fname\n"
+"      record for each loop the intended wakeup time, the wakeup error,\n"
+"      the buffer fill, and the number of bytes read and written. The\n"
+"      records are kept in memory and written to fname when the program\n"
+"      ends and on SIGUSR1 (without stopping). SIGINT and SIGTERM end\n"
+"      the loop as the stop command of 'hrtctl' (a second one ends the\n"
+"      program at once).\n"
+"      If fname ends in '.csv' a text file with comma separated values\n"
+"      is written, otherwise a compact binary file (see looprec.h).\n"
+"\n"
+"  --record-loops=intval, -U intval\n"
+"      the number of most recent loops kept with --record-file.\n"
+"      Default is 100000.\n"
+"\n"
+"  --control-shm=/name, -Y /name\n"
+"      create a small shared memory page with this name which is checked\n"
+"      once per loop. With the utility 'hrtctl' it can be used to change\n"
+"      --extra-bytes-per-second or the verbosity, to switch recording\n"
+"      (see --record-file) on and off, to get a snapshot of statistics, or\n"
+"      to stop (reading input, the buffered data are still written) while\n"
+"      the program is running.\n"
+"\n"
 "  --verbose, -v\n"
-"      print some information during startup and operation.\n"
+"      print some information during startup and operation. Given\n"
+"      twice, also the wakeup times of the loop are measured and shown\n"
+"      at the end (this costs two clock_gettime calls per loop).\n"
 "\n"
 "  --version, -V\n"
 "      print information about the version of the program and abort.\n"
@@ -162,6 +422,12 @@ void usage( ) {
 "                    --bytes-per-second=1536000 --loops-per-second=2000 \\\n"
 "                    --buffer-size=8096\n"
 "\n"
+"  The same stream served to up to three players in different rooms:\n"
+"\n"
+"  ...(filter)... | bufhrt --port-to-write 5888 --max-clients=3 \\\n"
+"                    --bytes-per-second=1536000 --loops-per-second=2000 \\\n"
+"                    --client-backlog=200000\n"
+"\n"
 "  A network buffer, reading from and writing to network:\n"
 "\n"
 "  bufhrt --host-to-read=myserver --port-to-read=5888 \\\n"
@@ -189,34 +455,736 @@ void usage( ) {
   );
 }
 
+/* multicast output, see --multicast */
+static struct mcast *mc = NULL;
+
+/* master of the shared timeline, see --clock-master */
+static struct clocksync *clk = NULL;
+
+/* io_uring engine for input and output files, see --io-uring */
+static struct uring *iring = NULL, *oring = NULL;
+
+/* checksums of all data read and written, see --verify */
+static int verify = 0;
+static unsigned int crcin = 0, crcout = 0;
+static long long vout = 0;
+
+/* read from the input, blocking */
+ssize_t fileread(int fd, void *ptr, size_t len)
+{
+    ssize_t s;
+
+    if (iring != NULL)
+        s = uring_read(iring, ptr, len, 1);
+    else
+        s = read(fd, ptr, len);
+    if (verify && s > 0)
+        crcin = crc32c(crcin, ptr, s);
+    return s;
+}
+
+/* reader thread for interval mode with several buffers, the reader
+   waits for 'empty[k]', fills buffer k and posts 'full[k]' */
+struct ibuffers {
+    int n, ifd;
+    long size, ilen;
+    char **buf;
+    long *len;        /* bytes in buffer */
+    int *last;        /* input ended in this buffer */
+    sem_t *empty, *full;
+};
+
+void *intervalreader(void *arg)
+{
+    struct ibuffers *ib = arg;
+    char *iptr;
+    int k;
+    long s;
+
+    for (k = 0; 1; k = (k+1) % ib->n) {
+        sem_wait(ib->empty+k);
+        memclean(ib->buf[k], ib->size);
+        ib->last[k] = 0;
+        for (iptr = ib->buf[k]; iptr < ib->buf[k] + ib->size - ib->ilen; ) {
+            s = fileread(ib->ifd, iptr, ib->ilen);
+            if (s < 0) {
+                fprintf(stderr, "bufhrt: Read error.\n");
+                exit(18);
+            }
+            if (s == 0) {
+                ib->last[k] = 1;
+                break;
+            }
+            iptr += s;
+        }
+        ib->len[k] = iptr - ib->buf[k];
+        sem_post(ib->full+k);
+        if (ib->last[k])
+            return NULL;
+    }
+}
+
+/* persistent listener, see --keep-listening */
+static int keepfd = -1;
+/* send buffer size, must be set again for accepted unix sockets */
+static int outbuf = 0;
+static long long connects = 0, disconnects = 0;
+
+/* kernel pacing, see --kernel-pacing, on pacefd or on all clients of
+   pacefo */
+static double pacingrate = 0.0;
+static int pacefd = -1;
+static struct fanout *pacefo = NULL;
+
+/* set pacing rate of socket (and, without --out-net-buffer-size, a send
+   buffer for about 0.1 seconds) */
+void setpacing(int fd, int verbose)
+{
+    unsigned int rate;
+    int sndbuf;
+
+    rate = (unsigned int)pacingrate;
+    if (setsockopt(fd, SOL_SOCKET, SO_MAX_PACING_RATE, &rate,
+                   sizeof(rate)) == -1) {
+        fprintf(stderr, "bufhrt: Cannot set pacing rate: %s.\n",
+                strerror(errno));
+        exit(31);
+    }
+    if (outbuf == 0) {
+        sndbuf = rate/10;
+        setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(int));
+    }
+    if (verbose)
+        fprintf(stderr, "bufhrt: Kernel pacing at %u bytes per second.\n",
+                rate);
+}
+
+/* runtime control page, see ctlpage.h */
+static struct ctlpage *ctl = NULL;
+static unsigned int ctlseq = 0;
+
+/* handle commands from the control page, the statistics are only
+   used for a snapshot, returns 1 if we should stop */
+int docontrol(long outpersec, double *extrabps, struct pacing *pc,
+              int *verbose, int *record, int canrecord, long long loops,
+              long long icount, long long ocount, long fill, long badreads,
+              long badwrites)
+{
+    unsigned int cmd;
+
+    cmd = ctlpage_cmd(ctl, &ctlseq);
+    if (cmd & CTL_EXTRA) {
+        *extrabps = ctl->extrabps;
+        pace_extra(pc, *extrabps);
+        if (*verbose)
+            fprintf(stderr, "bufhrt: Control: %.3f extra bytes per second, "
+                            "interval %ld nsec.\n", *extrabps, pc->nsec);
+        if (pacingrate > 0.0 && pacefo != NULL) {
+            pacingrate = 1.04*(outpersec+*extrabps);
+            fanout_pacing(pacefo, (unsigned int)pacingrate);
+        } else if (pacingrate > 0.0 && pacefd >= 0) {
+            pacingrate = 1.04*(outpersec+*extrabps);
+            setpacing(pacefd, *verbose);
+        }
+    }
+    if (cmd & CTL_VERBOSE)
+        *verbose = ctl->verbose;
+    if (cmd & CTL_STATS)
+        *record = canrecord && ctl->stats;
+    if (cmd & CTL_SNAPSHOT) {
+        ctl->loops = loops;
+        ctl->inbytes = icount;
+        ctl->outbytes = ocount;
+        ctl->delayed = 0;
+        ctl->badreads = badreads;
+        ctl->badwrites = badwrites;
+        ctl->fill = fill;
+        ctl->nsec = pc->nsec;
+        ctl->curextrabps = *extrabps;
+        ctl->connects = connects;
+        ctl->disconnects = disconnects;
+        ctlpage_snapdone(ctl, ctlseq);
+    }
+    if ((cmd & CTL_STOP) && *verbose)
+        fprintf(stderr, "bufhrt: Control: stopping.\n");
+    return (cmd & CTL_STOP) ? 1 : 0;
+}
+
+/* TCP send options, see --notsent-lowat, --nodelay and --msg-zerocopy */
+static int lowat = 0, nodelay = 0, zcmin = 0;
+
+/* outstanding MSG_ZEROCOPY sends: the kernel numbers them, we remember
+   the stream position where each one starts */
+#define ZCMAX 4096
+static long long zcpos[ZCMAX];
+static unsigned int zcsent = 0, zcdone = 0;
+static long long zctotal = 0, zccopied = 0;
+
+/* per loop statistics of the write calls, see --send-stats */
+static int sendstats = 0;
+/* kernel timestamps of the sent packets, see --tx-timestamps */
+static int txstamp = 0;
+static struct tstamp txts;
+static struct hist wrhist;
+static long long nqueue = 0, notsentsum = 0, notsentmax = 0, queuesum = 0,
+                 queuemax = 0;
+
+void tcpoptions(int fd)
+{
+    int one = 1;
+
+    if (lowat > 0 && setsockopt(fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &lowat,
+                                sizeof(int)) == -1) {
+        fprintf(stderr, "bufhrt: Cannot set TCP_NOTSENT_LOWAT: %s.\n",
+                strerror(errno));
+        exit(33);
+    }
+    if (nodelay && setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one,
+                              sizeof(int)) == -1) {
+        fprintf(stderr, "bufhrt: Cannot set TCP_NODELAY: %s.\n",
+                strerror(errno));
+        exit(33);
+    }
+    if (zcmin > 0 && setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &one,
+                                sizeof(int)) == -1) {
+        fprintf(stderr, "bufhrt: Cannot use MSG_ZEROCOPY: %s.\n",
+                strerror(errno));
+        exit(33);
+    }
+    if (txstamp)
+        tstamp_tx(&txts, fd);
+}
+
+/* read completion notifications from the error queue of the socket,
+   with wait we wait up to 100 msec for one */
+void zcreap(int fd, int wait)
+{
+    char control[256];
+    struct msghdr msg;
+    struct cmsghdr *cm;
+    struct sock_extended_err *serr;
+    struct pollfd pfd;
+
+    if (wait) {
+        pfd.fd = fd;
+        pfd.events = 0;
+        poll(&pfd, 1, 100);
+    }
+    while (1) {
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        if (recvmsg(fd, &msg, MSG_ERRQUEUE) == -1)
+            return;
+        /* the timestamps share the error queue */
+        if (txstamp && tstamp_errmsg(&txts, &msg))
+            continue;
+        for (cm = CMSG_FIRSTHDR(&msg); cm != NULL; cm = CMSG_NXTHDR(&msg, cm)) {
+            if (cm->cmsg_level != SOL_IP || cm->cmsg_type != IP_RECVERR)
+                continue;
+            serr = (struct sock_extended_err*)CMSG_DATA(cm);
+            if (serr->ee_errno != 0 ||
+                serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+                continue;
+            /* sends ee_info to ee_data are completed */
+            if (serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+                zccopied += serr->ee_data - serr->ee_info + 1;
+            if ((int)(serr->ee_data + 1 - zcdone) > 0)
+                zcdone = serr->ee_data + 1;
+        }
+    }
+}
+
+/* wait until all zero copy sends which start before stream position
+   pos are completed, then this part of the buffer can be reused */
+void zcwait(int fd, long long pos)
+{
+    if (zcsent == zcdone)
+        return;
+    zcreap(fd, 0);
+    while (zcsent != zcdone && zcpos[zcdone % ZCMAX] < pos)
+        zcreap(fd, 1);
+}
+
+/* send with MSG_ZEROCOPY, chunk starts at stream position pos */
+ssize_t zcsend(int fd, void *ptr, size_t len, long long pos)
+{
+    ssize_t s;
+
+    if (zcsent - zcdone >= ZCMAX - 1)
+        zcwait(fd, zcpos[zcdone % ZCMAX] + 1);
+    s = send(fd, ptr, len, MSG_ZEROCOPY);
+    if (s < 0 && errno == ENOBUFS)
+        /* too many pages pinned, copy this time */
+        return write(fd, ptr, len);
+    if (s > 0) {
+        zcpos[zcsent++ % ZCMAX] = pos;
+        zctotal++;
+    }
+    return s;
+}
+
+/* time of the write call and the socket queues */
+void sendstat(int fd, struct timespec *t0)
+{
+    struct timespec t1;
+    int notsent, queued;
+
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    hist_add(&wrhist, (t1.tv_sec-t0->tv_sec)*1000000000LL +
+                      t1.tv_nsec-t0->tv_nsec);
+    if (ioctl(fd, SIOCOUTQNSD, &notsent) < 0 ||
+        ioctl(fd, SIOCOUTQ, &queued) < 0)
+        return;
+    nqueue++;
+    notsentsum += notsent;
+    queuesum += queued;
+    if (notsent > notsentmax)
+        notsentmax = notsent;
+    if (queued > queuemax)
+        queuemax = queued;
+}
+
+void sendreport(int fd)
+{
+    if (zcmin > 0) {
+        zcwait(fd, 1LL<<62);
+        fprintf(stderr, "bufhrt: MSG_ZEROCOPY: %lld sends, %lld copied by "
+                        "the kernel anyway.\n", zctotal, zccopied);
+    }
+    if (txstamp)
+        tstamp_report(&txts);
+    if (sendstats) {
+        hist_print("bufhrt", "Write call", &wrhist);
+        if (nqueue > 0)
+            fprintf(stderr, "bufhrt: Bytes in socket not sent: avg %.0f, max "
+                            "%lld, not acknowledged: avg %.0f, max %lld.\n",
+                    1.0*notsentsum/nqueue, notsentmax, 1.0*queuesum/nqueue,
+                    queuemax);
+    }
+}
+
+/* accept a client on listenfd, report its address */
+int acceptclient(int listenfd, int verbose)
+{
+    struct sockaddr_storage addr;
+    socklen_t alen;
+    char host[NI_MAXHOST], serv[NI_MAXSERV];
+    int fd;
+
+    do {
+        alen = sizeof(addr);
+        fd = accept(listenfd, (struct sockaddr*)&addr, &alen);
+    } while (fd == -1 && errno == EINTR);
+    if (fd == -1) {
+        fprintf(stderr, "bufhrt: Cannot accept outgoing connection.\n");
+        exit(12);
+    }
+    connects++;
+    tcpoptions(fd);
+    if (outbuf != 0)
+        setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &outbuf, sizeof(int));
+    if (pacingrate > 0.0) {
+        pacefd = fd;
+        setpacing(fd, verbose);
+    }
+    if (verbose && addr.ss_family == AF_UNIX) {
+        fprintf(stderr, "bufhrt: Connection %lld on local socket.\n",
+                connects);
+    } else if (verbose) {
+        if (getnameinfo((struct sockaddr*)&addr, alen, host, NI_MAXHOST,
+                        serv, NI_MAXSERV, NI_NUMERICHOST | NI_NUMERICSERV) != 0)
+            strcpy(host, "?");
+        fprintf(stderr, "bufhrt: Connection %lld from %s (port %s).\n",
+                connects, host, serv);
+    }
+    return fd;
+}
+
+/* framed stream, see --framed and frame.h */
+static int framed = -1;
+static unsigned long long frameseq = 0;
+
+/* write a frame header and len bytes from ptr, returns len or -1 */
+ssize_t framewrite(int fd, void *ptr, size_t len)
+{
+    struct framehdr hdr;
+    struct iovec iov[2];
+    struct timespec t;
+    ssize_t s;
+    size_t done, n;
+
+    clock_gettime(framed == FRAME_TAI ? CLOCK_TAI : CLOCK_MONOTONIC, &t);
+    hdr.magic = FRAME_MAGIC;
+    hdr.len = len;
+    hdr.clock = framed;
+    hdr.pad = 0;
+    hdr.seq = frameseq;
+    hdr.tsend = t.tv_sec*1000000000LL + t.tv_nsec;
+    iov[0].iov_base = &hdr;
+    iov[0].iov_len = sizeof(hdr);
+    iov[1].iov_base = ptr;
+    iov[1].iov_len = len;
+    /* a frame must be written completely */
+    for (done = 0; done < sizeof(hdr)+len; done += s) {
+        s = writev(fd, iov, 2);
+        if (s < 0) {
+            if (errno == EINTR) {
+                s = 0;
+                continue;
+            }
+            return -1;
+        }
+        n = s;
+        if (n >= iov[0].iov_len) {
+            n -= iov[0].iov_len;
+            iov[0].iov_len = 0;
+            iov[1].iov_base = (char*)iov[1].iov_base + n;
+            iov[1].iov_len -= n;
+        } else {
+            iov[0].iov_base = (char*)iov[0].iov_base + n;
+            iov[0].iov_len -= n;
+        }
+    }
+    frameseq++;
+    return len;
+}
+
+/* receiver driven rate control, see --feedback and feedback.h */
+static int fbnet = 0, fbhave = 0;
+static struct ctlpage *fbctl = NULL;
+static struct feedback fbrep;
+static struct fbstate fbs;
+static long fbreports = 0;
+static long long fbtarget, fblast = 0, fbseen = 0;
+static double fbbase;
+
+/* get a new report of the receiver (from the connection or its control
+   page), returns 1 if one was available */
+int getfeedback(int fd, long outpersec, long long *fill, double *drift)
+{
+    long long t, lat, hwdelay, buffered;
+    int rate, outq;
+    ssize_t s;
+
+    if (fbctl != NULL) {
+        if (!ctlpage_getlatency(fbctl, &t, &lat, &hwdelay, &buffered, &rate)
+            || t == fbseen)
+            return 0;
+        fbseen = t;
+        feedback_update(&fbs, t, lat*outpersec/1000000000);
+        *fill = fbs.fill;
+        *drift = fbs.drift;
+        return 1;
+    }
+    s = recv(fd, (char*)&fbrep + fbhave, sizeof(fbrep) - fbhave, MSG_DONTWAIT);
+    if (s <= 0)
+        return 0;
+    fbhave += s;
+    if (fbhave < sizeof(fbrep))
+        return 0;
+    fbhave = 0;
+    if (fbrep.magic != FEEDBACK_MAGIC) {
+        fprintf(stderr, "bufhrt: Invalid feedback from receiver (is 'playhrt' "
+                        "called with --feedback?).\n");
+        exit(32);
+    }
+    /* also count what is still in our outgoing network buffer, the
+       drift is computed here from the total */
+    if (ioctl(fd, SIOCOUTQ, &outq) < 0)
+        outq = 0;
+    feedback_update(&fbs, fbrep.time, fbrep.fill + outq);
+    *fill = fbs.fill;
+    *drift = fbs.drift;
+    return 1;
+}
+
+/* adjust the extra bytes per second such that the fill of the receiver
+   stays at the value it had after a short settling time: a PI control
+   with time constants of about 10 and 20 seconds (critically damped),
+   the integral absorbs the drift of the clocks */
+void dofeedback(long outpersec, double *extrabps, struct pacing *pc,
+                int verbose, long long fill, double drift)
+{
+    double e, maxe, dt;
+
+    fbreports++;
+    if (fbreports < 30) {
+        fbbase = *extrabps;
+        fblast = fbs.time;
+        return;
+    }
+    if (fbreports == 30) {
+        fbtarget = fill;
+        if (verbose)
+            fprintf(stderr, "bufhrt: Feedback: target fill of receiver is "
+                            "%lld bytes.\n", fbtarget);
+    }
+    dt = (fbs.time - fblast)/1000000000.0;
+    fblast = fbs.time;
+    maxe = outpersec/100.0;
+    fbbase -= (fill - fbtarget)*dt/400.0;
+    if (fbbase > maxe)
+        fbbase = maxe;
+    if (fbbase < -maxe)
+        fbbase = -maxe;
+    e = fbbase - (fill - fbtarget)/10.0;
+    if (e > maxe)
+        e = maxe;
+    if (e < -maxe)
+        e = -maxe;
+    *extrabps = e;
+    pace_extra(pc, e);
+    if (verbose > 1 || (verbose && fbreports % 100 == 0))
+        fprintf(stderr, "bufhrt: Feedback: fill %lld, drift %.1f, extra bytes "
+                        "per second %.1f.\n", fill, drift, e);
+}
+
+/* write len bytes from ptr (or with ptr == NULL from the file ifd) to
+   the client, if the connection is lost and we keep listening, wait
+   for a new client and write to it, the timing starts anew then */
+ssize_t clientwrite(int *connfd, int ifd, void *ptr, size_t len,
+                    long long ocount, struct pacing *pc, int verbose)
+{
+    struct timespec t0;
+    long long tt = 0, sent = 0;
+    ssize_t s;
+
+    while (1) {
+        if (sendstats)
+            clock_gettime(CLOCK_MONOTONIC, &t0);
+        if (txstamp) {
+            tt = tstamp_now();
+            sent = mc != NULL ? mc->sent : 0;
+        }
+        if (ptr == NULL)
+            s = sendfile(*connfd, ifd, NULL, len);
+        else if (framed >= 0)
+            s = framewrite(*connfd, ptr, len);
+        else if (zcmin > 0 && len >= zcmin)
+            s = zcsend(*connfd, ptr, len, ocount);
+        else if (oring != NULL)
+            s = uring_write(oring, ptr, len);
+        else if (mc != NULL)
+            s = mcast_write(mc, ptr, len);
+        else
+            s = write(*connfd, ptr, len);
+        if (sendstats && s >= 0)
+            sendstat(*connfd, &t0);
+        /* keys count datagrams (UDP) or bytes (TCP, with frame headers) */
+        if (txstamp && s > 0) {
+            if (mc != NULL)
+                tstamp_sent(&txts, tt, mc->sent - sent);
+            else
+                tstamp_sent(&txts, tt, s + (framed >= 0 ?
+                                            sizeof(struct framehdr) : 0));
+            if (zcmin > 0)
+                zcreap(*connfd, 0);
+            else
+                tstamp_reap(&txts);
+        }
+        if (verify && s > 0) {
+            crcout = crc32c(crcout, ptr, s);
+            vout += s;
+        }
+        if (s >= 0 || keepfd < 0 ||
+            (errno != EPIPE && errno != ECONNRESET && errno != ETIMEDOUT))
+            return s;
+        disconnects++;
+        /* the old socket takes its zero copy sends with it, the new one
+           counts from 0 */
+        zcsent = zcdone = 0;
+        if (verbose)
+            fprintf(stderr, "bufhrt: Connection lost after %lld bytes, "
+                            "waiting for new connection.\n", ocount);
+        close(*connfd);
+        *connfd = acceptclient(keepfd, verbose);
+        pace_start(pc);
+    }
+}
+
+/* the output of the timed loops, for pace_write */
+struct outsink {
+    struct fanout *fo;
+    int *connfd;
+    int ifd;
+    long long *ocount;
+    int *verbose;
+    struct pacing *pc;
+};
+
+ssize_t outwrite(void *arg, void *ptr, size_t len)
+{
+    struct outsink *o = arg;
+    ssize_t s;
+
+    if (o->fo != NULL)
+        return fanout_write(o->fo, ptr, len);
+    s = clientwrite(o->connfd, o->ifd, ptr, len, *o->ocount, o->pc,
+                    *o->verbose);
+    /* the stream reference for the players */
+    if (clk != NULL && s > 0)
+        clocksync_mark(clk, *o->ocount + s, &o->pc->next,
+                       o->pc->unitspersec + o->pc->extra);
+    return s;
+}
+
+/* print CPU time used so far and throughput since start */
+void cpureport(long long bytes, struct timespec *start)
+{
+    struct rusage ru;
+    struct timespec now;
+    double sec;
+
+    getrusage(RUSAGE_SELF, &ru);
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    sec = (now.tv_sec-start->tv_sec) + (now.tv_nsec-start->tv_nsec)*1e-9;
+    fprintf(stderr, "bufhrt: CPU time %.3f sec user, %.3f sec system, "
+                    "%.0f bytes per second in %.3f sec.\n",
+            ru.ru_utime.tv_sec + ru.ru_utime.tv_usec*1e-6,
+            ru.ru_stime.tv_sec + ru.ru_stime.tv_usec*1e-6,
+            sec > 0.0 ? bytes/sec : 0.0, sec);
+}
+
+/* --verify: the data written must have the same checksum as the data
+   read, and so must the output file when it is read back from the disk
+   (we drop it from the page cache first); an existing longer file is
+   cut to the data written, as with --io-uring */
+void verifyoutput(char *outfile, int verbose)
+{
+    struct timespec t0, t1;
+    unsigned int crc;
+    long long n;
+    ssize_t s;
+    char *b;
+    int fd;
+
+    if (crcout != crcin) {
+        fprintf(stderr, "bufhrt: Verify: data written differ from data "
+                        "read.\n");
+        exit(34);
+    }
+    if (truncate(outfile, vout) == -1) {
+        fprintf(stderr, "bufhrt: Verify: cannot truncate %s: %s.\n", outfile,
+                strerror(errno));
+        exit(34);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    if ((fd = open(outfile, O_RDONLY)) == -1 || (b = malloc(1<<20)) == NULL) {
+        fprintf(stderr, "bufhrt: Verify: cannot read %s.\n", outfile);
+        exit(34);
+    }
+    fdatasync(fd);
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    for (crc = 0, n = 0; (s = read(fd, b, 1<<20)) > 0; n += s)
+        crc = crc32c(crc, b, s);
+    close(fd);
+    free(b);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    if (s < 0 || crc != crcout || n != vout) {
+        fprintf(stderr, "bufhrt: Verify: %s (%lld bytes) differs from the "
+                        "data written (%lld bytes).\n", outfile, n, vout);
+        exit(34);
+    }
+    if (verbose)
+        fprintf(stderr, "bufhrt: Verify: %lld bytes with CRC32C %08x (%s), "
+                        "rereading took %.3f sec.\n", n, crc, crc32c_impl(),
+                        (t1.tv_sec-t0.tv_sec) + (t1.tv_nsec-t0.tv_nsec)*1e-9);
+}
+
+/* shared memory input: chunks taken ahead while the previous one was
+   written, and the time spent blocked in sem_wait (writeloop too slow) */
+static long long shmchunks = 0, shmahead = 0, shmblocked = 0, shmlate = 0,
+                 shmreleases = 0;
+static double shmwaitsec = 0.0, shmwaitmax = 0.0;
+
+/* wait for a chunk, count it if this takes us past the wakeup time
+   after the next one (the following loops are then shorter) */
+void shmwait(sem_t *sem, struct pacing *pc)
+{
+    struct timespec t0, t1;
+    double d;
+
+    shmchunks++;
+    if (sem_trywait(sem) == 0)
+        return;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    while (sem_wait(sem) != 0) ;
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    d = (t1.tv_sec-t0.tv_sec) + (t1.tv_nsec-t0.tv_nsec)*1e-9;
+    shmblocked++;
+    shmwaitsec += d;
+    if (d > shmwaitmax)
+        shmwaitmax = d;
+    if ((t1.tv_sec-pc->next.tv_sec)*1000000000LL + t1.tv_nsec-pc->next.tv_nsec
+        > pc->nsec)
+        shmlate++;
+}
+
+void shmreport()
+{
+    fprintf(stderr, "bufhrt: Shared memory: %lld chunks (%lld taken ahead) "
+                    "released in %lld batches.\n", shmchunks, shmahead,
+                    shmreleases);
+    fprintf(stderr, "bufhrt: Blocked %lld times waiting for writeloop, "
+                    "%.3f ms total, %.3f ms max, %lld loops delayed.\n",
+                    shmblocked, shmwaitsec*1000.0, shmwaitmax*1000.0, shmlate);
+}
+
 int main(int argc, char *argv[])
 {
-    struct sockaddr_in serv_addr;
-    int listenfd, connfd, ifd, s, moreinput, optval=1, verbose, rate,
-        extrabps, bytesperframe, optc, interval, shared, innetbufsize,
-        outnetbufsize;
-    long blen, hlen, ilen, olen, outpersec, loopspersec, nsec, count, wnext,
-         badreads, badreadbytes, badwrites, badwritebytes, lcount;
-    long long icount, ocount;
+    int listenfd, connfd, ifd, s, moreinput, verbose, rate,
+        bytesperframe, optc, interval, shared, innetbufsize,
+        outnetbufsize, readloops, record, stop, maxclients, dropslow,
+        zerocopy, keeplisten, nibufs, k, kpacing, fbloops, uringdepth,
+        pending;
+    long blen, hlen, ilen, olen, outpersec, loopspersec, count, wnext,
+         badreads, badreadbytes, badwrites, badwritebytes, lcount,
+         nrecs, rd, wr, backlog, under, catchup, wmax;
+    long long icount, ocount, nreads, fbfill, insize;
     void *buf, *iptr, *optr, *max;
-    char *port, *inhost, *inport, *outfile, *infile;
-    struct timespec mtime;
-    double looperr, extraerr, off;
+    char *port, *inhost, *inport, *outfile, *infile, *recfile, *ctlname,
+         *fbname, *mcname, *clkport, *clkoffset;
+    struct timespec mstart;
+    double extrabps, fbdrift, catchrate;
     /* variables for shared memory input */
-    char **fname, *fnames[100], **tmpname, *tmpnames[100], **mem, *mems[100],
-         *ptr;
-    sem_t **sem, *sems[100], **semw, *semsw[100];
-    int fd[100], i, flen, size, c, sz;
+    char **fname, *fnames[100], **tmpname, *tmpnames[100], *mems[100],
+         *ptr, *aptr;
+    sem_t *sems[100], *semsw[100];
+    int fd[100], i, flen, size, c, sz, nseg, cur, nxt, relbatch, npend,
+        pend[100], alen, apos, apass, an, ahead;
     struct stat sb;
+    struct fanout *fo;
+    struct ibuffers ib;
+    pthread_t ithread;
+    struct pacing pc;
+    struct outsink osink;
 
     /* read command line options */
     static struct option longoptions[] = {
         {"port-to-write", required_argument,       0,  'p' },
         /* for backward compatibility */
         {"port", required_argument,       0,  'p' },
+        {"max-clients", required_argument, 0, 'N' },
+        {"client-backlog", required_argument, 0, 'B' },
+        {"slow-clients", required_argument, 0, 'W' },
+        {"multicast", required_argument, 0, 'A' },
+        {"clock-master", required_argument, 0, 'a' },
+        {"clock-offset", required_argument, 0, 'g' },
+        {"framed", required_argument, 0, 'E' },
+        {"feedback", required_argument, 0, 'Q' },
+        {"kernel-pacing", no_argument, 0, 'J' },
+        {"keep-listening", no_argument, 0, 'k' },
+        {"notsent-lowat", required_argument, 0, 'l' },
+        {"nodelay", no_argument, 0, 'y' },
+        {"msg-zerocopy", required_argument, 0, 'z' },
+        {"send-stats", no_argument, 0, 'X' },
+        {"tx-timestamps", no_argument, 0, 't' },
+        {"verify", no_argument, 0, 'q' },
         {"outfile", required_argument, 0, 'o' },
         {"buffer-size", required_argument,       0,  'b' },
         {"input-size",  required_argument, 0, 'i'},
+        {"loops-per-read", required_argument, 0, 'R' },
         {"loops-per-second", required_argument, 0,  'n' },
         {"bytes-per-second", required_argument, 0,  'm' },
         {"sample-rate", required_argument, 0,  's' },
@@ -226,11 +1194,20 @@ int main(int argc, char *argv[])
         {"port-to-read", required_argument, 0, 'P' },
         {"stdin", no_argument, 0, 'S' },
         {"shared", no_argument, 0, 'M' },
+        {"release-batch", required_argument, 0, 'j' },
         {"extra-bytes-per-second", required_argument, 0, 'e' },
+        {"catch-up", required_argument, 0, 'c' },
+        {"catch-up-rate", required_argument, 0, 'C' },
         {"in-net-buffer-size", required_argument, 0, 'K' },
         {"out-net-buffer-size", required_argument, 0, 'L' },
         {"overwrite", required_argument, 0, 'O' }, /* not used, ignored */
         {"interval", no_argument, 0, 'I' },
+        {"interval-buffers", required_argument, 0, 'G' },
+        {"zero-copy", no_argument, 0, 'Z' },
+        {"io-uring", required_argument, 0, 'D' },
+        {"record-file", required_argument, 0, 'T' },
+        {"record-loops", required_argument, 0, 'U' },
+        {"control-shm", required_argument, 0, 'Y' },
         {"verbose", no_argument, 0, 'v' },
         {"version", no_argument, 0, 'V' },
         {"help", no_argument, 0, 'h' },
@@ -260,15 +1237,100 @@ int main(int argc, char *argv[])
     shared = 0;
     interval = 0;
     extrabps = 0;
+    catchup = 0;
+    catchrate = 5.0;
     innetbufsize = 0;
     outnetbufsize = 0;
+    readloops = 1;
+    recfile = NULL;
+    nrecs = 100000;
+    ctlname = NULL;
+    maxclients = 1;
+    backlog = 0;
+    dropslow = 0;
+    fo = NULL;
+    zerocopy = 0;
+    keeplisten = 0;
+    nibufs = 1;
+    kpacing = 0;
+    fbname = NULL;
+    mcname = NULL;
+    clkport = NULL;
+    clkoffset = NULL;
+    uringdepth = 0;
+    relbatch = 1;
     verbose = 0;
-    while ((optc = getopt_long(argc, argv, "p:o:b:i:n:m:s:f:F:H:P:e:vVh",
+    while ((optc = getopt_long(argc, argv, "p:N:B:W:A:E:Q:Jkl:yz:Xo:b:i:R:n:m:s:f:F:H:P:e:T:U:Y:ZD:G:vVh",
             longoptions, &optind)) != -1) {
         switch (optc) {
         case 'p':
           port = optarg;
           break;
+        case 'N':
+          maxclients = atoi(optarg);
+          if (maxclients < 1)
+              maxclients = 1;
+          break;
+        case 'B':
+          backlog = atoi(optarg);
+          break;
+        case 'W':
+          if (strcmp(optarg, "drop") == 0) {
+              dropslow = 1;
+          } else if (strcmp(optarg, "resync") == 0) {
+              dropslow = 0;
+          } else {
+              fprintf(stderr, "bufhrt: --slow-clients must be 'resync' or 'drop'.\n");
+              exit(1);
+          }
+          break;
+        case 'E':
+          if (strcmp(optarg, "mono") == 0) {
+              framed = FRAME_MONO;
+          } else if (strcmp(optarg, "tai") == 0) {
+              framed = FRAME_TAI;
+          } else {
+              fprintf(stderr, "bufhrt: --framed must be 'mono' or 'tai'.\n");
+              exit(1);
+          }
+          break;
+        case 'A':
+          mcname = optarg;
+          break;
+        case 'a':
+          clkport = optarg;
+          break;
+        case 'g':
+          clkoffset = optarg;
+          break;
+        case 'Q':
+          fbname = optarg;
+          break;
+        case 'J':
+          kpacing = 1;
+          break;
+        case 'k':
+          keeplisten = 1;
+          break;
+        case 'l':
+          lowat = atoi(optarg);
+          break;
+        case 'y':
+          nodelay = 1;
+          break;
+        case 'z':
+          zcmin = atoi(optarg);
+          if (zcmin < 0)
+              zcmin = 0;
+          break;
+        case 'X':
+          sendstats = 1;
+          hist_init(&wrhist);
+          break;
+        case 't':
+          txstamp = 1;
+          tstamp_init(&txts, "bufhrt");
+          break;
         case 'o':
           outfile = optarg;
           if ((connfd = open(outfile, O_WRONLY | O_CREAT, 00644)) == -1) {
@@ -283,6 +1345,11 @@ int main(int argc, char *argv[])
         case 'i':
           ilen = atoi(optarg);
           break;
+        case 'R':
+          readloops = atoi(optarg);
+          if (readloops < 1)
+              readloops = 1;
+          break;
         case 'n':
           loopspersec = atoi(optarg);
           break;
@@ -325,9 +1392,23 @@ int main(int argc, char *argv[])
         case 'M':
           shared = 1;
           break;
+        case 'q':
+          verify = 1;
+          break;
+        case 'j':
+          relbatch = atoi(optarg);
+          if (relbatch < 1)
+              relbatch = 1;
+          break;
         case 'e':
           extrabps = atof(optarg);
           break;
+        case 'c':
+          catchup = atol(optarg);
+          break;
+        case 'C':
+          catchrate = atof(optarg);
+          break;
         case 'K':
           innetbufsize = atoi(optarg);
           if (innetbufsize != 0 && innetbufsize < 128)
@@ -343,8 +1424,30 @@ int main(int argc, char *argv[])
         case 'I':
           interval = 1;
           break;
+        case 'Z':
+          zerocopy = 1;
+          break;
+        case 'D':
+          uringdepth = atoi(optarg);
+          if (uringdepth < 0)
+              uringdepth = 0;
+          break;
+        case 'G':
+          nibufs = atoi(optarg);
+          if (nibufs < 1)
+              nibufs = 1;
+          break;
+        case 'T':
+          recfile = optarg;
+          break;
+        case 'U':
+          nrecs = atoi(optarg);
+          break;
+        case 'Y':
+          ctlname = optarg;
+          break;
         case 'v':
-          verbose = 1;
+          verbose += 1;
           break;
         case 'V':
           fprintf(stderr,
@@ -357,6 +1460,95 @@ int main(int argc, char *argv[])
         }
     }
     /* check some arguments and set some parameters */
+    if (mcname != NULL && (port != NULL || outfile != NULL || zerocopy ||
+                           fbname != NULL)) {
+       fprintf(stderr, "bufhrt: --multicast is not possible with "
+                       "--port-to-write, --outfile, --zero-copy or --feedback.\n");
+       exit(5);
+    }
+    if (clkport != NULL && (mcname == NULL || zerocopy)) {
+       fprintf(stderr, "bufhrt: --clock-master needs --multicast.\n");
+       exit(5);
+    }
+    if (fbname != NULL) {
+       if (strcmp(fbname, "net") == 0) {
+           if (port == NULL || maxclients > 1) {
+               fprintf(stderr, "bufhrt: --feedback=net needs --port-to-write "
+                               "and a single client.\n");
+               exit(5);
+           }
+           fbnet = 1;
+       } else if ((fbctl = ctlpage_attach("bufhrt", fbname)) == NULL) {
+           exit(5);
+       }
+    }
+    if ((lowat > 0 || nodelay || zcmin > 0) &&
+        (port == NULL || fd_isunix(port) || maxclients > 1)) {
+       fprintf(stderr, "bufhrt: --notsent-lowat, --nodelay and --msg-zerocopy "
+                       "need --port-to-write (TCP) and a single client.\n");
+       exit(5);
+    }
+    if (nibufs > 1 && !interval) {
+       fprintf(stderr, "bufhrt: --interval-buffers needs --interval.\n");
+       exit(5);
+    }
+    if (shared && relbatch > 1 && relbatch >= argc-optind) {
+       fprintf(stderr, "bufhrt: --release-batch must be smaller than the "
+                       "number of shared memory files.\n");
+       exit(5);
+    }
+    if (verify && (outfile == NULL || port != NULL || mcname != NULL ||
+                   shared || zerocopy)) {
+       fprintf(stderr, "bufhrt: --verify needs --outfile, and not --shared "
+                       "or --zero-copy.\n");
+       exit(5);
+    }
+    if (catchup < 0 || catchrate <= 0.0) {
+       fprintf(stderr, "bufhrt: --catch-up and --catch-up-rate must be "
+                       "positive.\n");
+       exit(5);
+    }
+    if (catchup > 0 && (interval || shared || zerocopy)) {
+       fprintf(stderr, "bufhrt: --catch-up is not possible with --interval, "
+                       "--shared or --zero-copy.\n");
+       exit(5);
+    }
+    if (verify)
+       crc32c_impl();   /* choose the implementation before any thread */
+    if (zcmin > 0 && shared) {
+       fprintf(stderr, "bufhrt: --msg-zerocopy is not possible with "
+                       "--shared.\n");
+       exit(5);
+    }
+    if (uringdepth > 0 && zerocopy) {
+       fprintf(stderr, "bufhrt: --io-uring is not possible with "
+                       "--zero-copy.\n");
+       exit(5);
+    }
+    if (zerocopy && maxclients > 1) {
+       fprintf(stderr, "bufhrt: --zero-copy works only with one client.\n");
+       exit(5);
+    }
+    if (kpacing && fd_isunix(port)) {
+       fprintf(stderr, "bufhrt: --kernel-pacing is not possible with a "
+                       "local socket.\n");
+       exit(5);
+    }
+    /* a local socket needs no port */
+    if (fd_isunix(inhost) && inport == NULL)
+       inport = inhost;
+    if (txstamp && ((port == NULL && mcname == NULL) || zerocopy ||
+                    maxclients > 1)) {
+       fprintf(stderr, "bufhrt: --tx-timestamps needs --port-to-write (and "
+                       "a single client) or --multicast, and not "
+                       "--zero-copy.\n");
+       exit(5);
+    }
+    if (framed >= 0 && (port == NULL || zerocopy || maxclients > 1)) {
+       fprintf(stderr, "bufhrt: --framed needs --port-to-write, and not "
+                       "--zero-copy or --max-clients.\n");
+       exit(5);
+    }
     if (outpersec == 0) {
        if (rate != 0 && bytesperframe != 0) {
            outpersec = rate * bytesperframe;
@@ -377,8 +1569,11 @@ int main(int argc, char *argv[])
     }
     if (verbose) {
        fprintf(stderr, "bufhrt: Writing %ld bytes per second to ", outpersec);
-       if (port != NULL)
-          fprintf(stderr, "port %s.\n", port);
+       if (mcname != NULL)
+          fprintf(stderr, "multicast group %s.\n", mcname);
+       else if (port != NULL)
+          fprintf(stderr, "%s %s.\n", fd_isunix(port) ? "local socket" :
+                                       "port", fd_isunix(port) ? port+5 : port);
        else if (connfd == 1)
           fprintf(stderr, "stdout.\n");
        else
@@ -388,6 +1583,8 @@ int main(int argc, char *argv[])
           fprintf(stderr, "shared memory");
        else if (ifd == 0)
           fprintf(stderr, "stdin");
+       else if (fd_isunix(inhost))
+          fprintf (stderr, "local socket %s", inhost + 5);
        else if (inhost != NULL)
           fprintf (stderr, "host %s (port %s)", inhost, inport);
        else
@@ -395,11 +1592,19 @@ int main(int argc, char *argv[])
        fprintf(stderr, ", output in %ld loops per second.\n", loopspersec);
     }
 
-    extraerr = 1.0*outpersec/(outpersec+extrabps);
-    nsec = (int) (1000000000*extraerr/loopspersec);
-    olen = outpersec/loopspersec;
-    if (olen <= 0)
-        olen = 1;
+    /* with -v -v the wakeup times are measured */
+    pace_init(&pc, "bufhrt", outpersec, loopspersec, extrabps,
+              verbose > 1 ? 2 : 0);
+    pc.record = &record;
+    olen = pc.size;
+    /* at most wmax bytes are written per loop */
+    if (catchup > 0)
+        pace_catchup(&pc, catchup, catchrate);
+    wmax = 2*olen + pc.burst;
+    /* look for feedback about ten times per second */
+    fbloops = loopspersec/10;
+    if (fbloops < 1)
+        fbloops = 1;
     if (interval) {
         if (ilen == 0)
             ilen = 16384;
@@ -415,64 +1620,109 @@ int main(int argc, char *argv[])
            fflush(stderr);
         }
     }
+    /* with fewer reads we need larger chunks */
+    if (!interval && readloops > 1 && ilen < readloops*(olen+1)) {
+        ilen = readloops*(olen+1);
+        if (verbose)
+           fprintf(stderr, "bufhrt: Reading every %d loops, input chunks of %ld bytes.\n",
+                           readloops, ilen);
+    }
+    /* the input must be able to refill the buffer while catching up */
+    if (catchup > 0) {
+        ilen += readloops*pc.burst;
+        if (verbose)
+           fprintf(stderr, "bufhrt: Catch-up with up to %lld extra bytes per "
+                           "second, input chunks of %ld bytes.\n",
+                           pc.crate, ilen);
+    }
     if (blen < 3*(ilen+olen))
         blen = 3*(ilen+olen);
     hlen = blen/2;
-    if (olen*loopspersec == outpersec)
-        looperr = 0.0;
-    else
-        looperr = (1.0*outpersec)/loopspersec - 1.0*olen;
     moreinput = 1;
     icount = 0;
     ocount = 0;
+    nreads = 0;
+
+    record = (recfile != NULL);
+    if (record)
+        looprec_init("bufhrt", recfile, nrecs);
+    if (ctlname != NULL)
+        ctl = ctlpage_open("bufhrt", ctlname);
+    stop = 0;
+
+    /* io_uring for input and output files */
+    if (uringdepth > 0) {
+        insize = 0;
+        if (infile != NULL && fstat(ifd, &sb) == 0 && S_ISREG(sb.st_mode)) {
+            insize = sb.st_size;
+            iring = uring_open("bufhrt", ifd, 0, uringdepth, ilen, 0, verbose);
+        }
+        if (port == NULL && outfile != NULL && fstat(connfd, &sb) == 0 &&
+            S_ISREG(sb.st_mode))
+            oring = uring_open("bufhrt", connfd, 1, uringdepth, olen, insize,
+                               verbose);
+        if (iring == NULL && oring == NULL) {
+            fprintf(stderr, "bufhrt: --io-uring needs a regular --file or "
+                            "--outfile.\n");
+            exit(5);
+        }
+    }
 
     /* we want buf % 8 = 0 */
-    if (! (buf = malloc(blen+ilen+2*olen+8)) ) {
+    if (! (buf = malloc(blen+ilen+wmax+8)) ) {
         fprintf(stderr, "bufhrt: Cannot allocate buffer of length %ld.\n",
-                blen+ilen+olen);
+                blen+ilen+wmax+8);
         exit(6);
     }
     while (((uintptr_t)buf % 8) != 0) buf++;
-    buf = buf + 2*olen;
+    buf = buf + wmax;
     max = buf + blen;
     iptr = buf;
     optr = buf;
 
     /* outgoing socket */
     if (port != 0) {
-        listenfd = socket(AF_INET, SOCK_STREAM, 0);
-        if (listenfd < 0) {
-            fprintf(stderr, "bufhrt: Cannot create outgoing socket.\n");
-            exit(9);
-        }
-        if (setsockopt(listenfd,
-                       SOL_SOCKET,SO_REUSEADDR,&optval,sizeof(int)) == -1)
-        {
-            fprintf(stderr, "bufhrt: Cannot set REUSEADDR.\n");
-            exit(10);
-        }
-        if (outnetbufsize != 0 && setsockopt(listenfd,
-                       SOL_SOCKET,SO_SNDBUF,&outnetbufsize,sizeof(int)) == -1)
-        {
-            fprintf(stderr, "bufhrt: Cannot set outgoing network buffer to %d.\n",
-                    outnetbufsize);
-            exit(30);
-        }
-        memset(&serv_addr, '0', sizeof(serv_addr));
-        serv_addr.sin_family = AF_INET;
-        serv_addr.sin_addr.s_addr = htonl(INADDR_ANY);
-        serv_addr.sin_port = htons(atoi(port));
-        if (bind(listenfd, (struct sockaddr*)&serv_addr,
-                                              sizeof(serv_addr)) == -1) {
-            fprintf(stderr, "bufhrt: Cannot bind outgoing socket.\n");
-            exit(11);
-        }
-        listen(listenfd, 1);
-        if ((connfd = accept(listenfd, (struct sockaddr*)NULL, NULL)) == -1) {
-            fprintf(stderr, "bufhrt: Cannot accept outgoing connection.\n");
-            exit(12);
+        if (kpacing)
+            pacingrate = 1.04*(outpersec+extrabps);
+        listenfd = fd_listen("bufhrt", port, outnetbufsize, maxclients);
+        outbuf = outnetbufsize;
+        if (maxclients > 1) {
+            /* fan-out to several clients, we wait for the first one */
+            if (backlog < blen)
+                backlog = blen;
+            fo = fanout_new("bufhrt", listenfd, maxclients, backlog,
+                            dropslow, verbose);
+            fo->sndbuf = outnetbufsize;
+            if (pacingrate > 0.0) {
+                fo->pacing = (unsigned int)pacingrate;
+                pacefo = fo;
+                if (verbose)
+                    fprintf(stderr, "bufhrt: Kernel pacing at %u bytes per "
+                                    "second for each client.\n", fo->pacing);
+            }
+            fanout_accept(fo, 1);
+            connfd = -1;
+        } else {
+            if (keeplisten) {
+                /* lost connections are seen as write errors */
+                signal(SIGPIPE, SIG_IGN);
+                keepfd = listenfd;
+            }
+            connfd = acceptclient(listenfd, verbose);
         }
     }
+    if (mcname != NULL)
+        mc = mcast_sender("bufhrt", mcname, outnetbufsize, verbose);
+    if (txstamp && mc != NULL)
+        tstamp_tx(&txts, mc->fd);
+    if (clkport != NULL)
+        clk = clocksync_master("bufhrt", clkport, clkoffset, verbose);
+    osink.fo = fo;
+    osink.connfd = &connfd;
+    osink.ifd = ifd;
+    osink.ocount = &ocount;
+    osink.verbose = &verbose;
+    osink.pc = &pc;
     /* shared memory input */
     if (shared) {
       size = 0;
@@ -493,7 +1743,7 @@ int main(int argc, char *argv[])
                  exit(20);
              }
              /* also semaphore for write lock */
-             tmpnames[i-optind] = (char*)malloc(strlen(argv[i])+5);
+             tmpnames[i-optind] = (char*)calloc(strlen(argv[i])+5, 1);
              strncpy(tmpnames[i-optind], fnames[i-optind], strlen(argv[i]));
              strncat(tmpnames[i-optind], ".TMP", 4);
              if ((semsw[i-optind] = sem_open(tmpnames[i-optind], O_RDWR))
@@ -524,28 +1774,23 @@ int main(int argc, char *argv[])
          }
       }
       fnames[argc-optind] = NULL;
-      fname = fnames;
-      tmpname = tmpnames;
-      mem = mems;
-      sem = sems;
-      semw = semsw;
-      clock_gettime(CLOCK_MONOTONIC, &mtime);
+      nseg = argc-optind;
+      pace_start(&pc);
       lcount = 0;
-      off = looperr;
-      i = 0; /* counter to update mtime */
+      i = 0; /* counter to restart the timeline */
+      cur = 0;
+      nxt = -1;
+      npend = 0;
       while (1) {
          i++;
-         if (*fname == NULL) {
-            fname = fnames;
-            tmpname = tmpnames;
-            mem = mems;
-            sem = sems;
-            semw = semsw;
-         }
-         /* get lock */
-         sem_wait(*sem);
+         /* get lock, unless we have taken this chunk ahead */
+         if (nxt < 0)
+             shmwait(sems[cur], &pc);
+         /* was it refreshed twice while the previous one was written? */
+         ahead = (nxt >= 0 && apass >= 2);
+         nxt = -1;
          /* find length of relevant memory chunk */
-         flen = *((int*)(*mem));
+         flen = *((int*)(mems[cur]));
          icount += flen;
          if (flen == 0) {
              /* done, unlink semaphores and shared memory */
@@ -558,37 +1803,54 @@ int main(int argc, char *argv[])
                  fname++;
                  tmpname++;
              }
-             exit(0);
+             /* the outputs are closed below */
+             break;
          }
          /* write shared memory content to output */
-         ptr = *mem + sizeof(int);
+         ptr = mems[cur] + sizeof(int);
          sz = 0;
          if (i == 100)
-           clock_gettime(CLOCK_MONOTONIC, &mtime);
+           pace_start(&pc);
          while (sz < flen) {
-             mtime.tv_nsec += nsec;
-             if (mtime.tv_nsec > 999999999) {
-               mtime.tv_nsec -= 1000000000;
-               mtime.tv_sec++;
-             }
-             if (flen - sz <= olen) {
+             pace_step(&pc);
+             /* the rest of a chunk may be shorter, the missing bytes are
+                added to the next loops */
+             c = pace_size(&pc);
+             if (c > flen - sz) {
+                 pace_owe(&pc, c - (flen - sz));
                  c = flen - sz;
-                 off += (olen-c);
-             } else {
-                 c = olen;
-                 if (off >= 1.0) {
-                    off -= 1.0;
-                    c++;
+             }
+             /* take the next chunk as soon as writeloop has filled it */
+             if (nxt < 0 && nseg > 1 &&
+                 sem_trywait(sems[(cur+1) % nseg]) == 0) {
+                 nxt = (cur+1) % nseg;
+                 aptr = mems[nxt] + sizeof(int);
+                 alen = *((int*)(mems[nxt]));
+                 apos = 0;
+                 apass = 0;
+                 shmchunks++;
+                 shmahead++;
+             }
+             /* and refresh it twice, up to 2*olen bytes in each loop (as
+                much as the two extra passes over the current chunk did
+                before) */
+             for (k = 0; k < 2 && nxt >= 0 && apass < 2 && alen > 0; k++) {
+                 an = (alen - apos < olen) ? alen - apos : olen;
+                 refreshmem(aptr + apos, an);
+                 apos += an;
+                 if (apos == alen) {
+                     apos = 0;
+                     apass++;
                  }
              }
+             /* otherwise the two extra passes are done here */
+             if (!ahead) {
+                 refreshmem((char*)ptr, c);
+                 refreshmem((char*)ptr, c);
+             }
              refreshmem((char*)ptr, c);
-             refreshmem((char*)ptr, c);
-             refreshmem((char*)ptr, c);
-             while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME,
-                                                                &mtime, NULL)
-                    != 0) ;
              /* write a chunk, this comes first after waking from sleep */
-             s = write(connfd, ptr, c);
+             s = pace_write(&pc, outwrite, &osink, ptr, c);
              if (s < 0) {
                  fprintf(stderr, "bufhrt (from shared): Write error: %s.\n",
                                  strerror(errno));
@@ -597,21 +1859,56 @@ int main(int argc, char *argv[])
              if (s < c) {
                  badwrites++;
                  badwritebytes += (c-s);
-                 off += (c-s);
+                 pace_owe(&pc, c-s);
              }
              ocount += c;
              ptr += c;
              sz += c;
              lcount++;
-             off += looperr;
+             if (record)
+                 looprec_add(flen-sz, 0, s);
+             if (looprec_sig)
+                 stop |= looprec_check();
+             if (ctl != NULL && ctl->seq != ctlseq)
+                 stop |= docontrol(outpersec, &extrabps, &pc,
+                                   &verbose, &record, recfile != NULL, lcount,
+                                   icount, ocount, flen-sz, 0, badwrites);
+             if ((fbnet || fbctl != NULL) && lcount % fbloops == 0 &&
+                 getfeedback(connfd, outpersec, &fbfill, &fbdrift))
+                 dofeedback(outpersec, &extrabps, &pc, verbose,
+                            fbfill, fbdrift);
+         }
+         /* mark as writable, in batches of relbatch chunks */
+         pend[npend++] = cur;
+         if (npend >= relbatch || stop) {
+             for (k = 0; k < npend; k++)
+                 sem_post(semsw[pend[k]]);
+             npend = 0;
+             shmreleases++;
          }
-         /* mark as writable */
-         sem_post(*semw);
-         fname++;
-         tmpname++;
-         mem++;
-         sem++;
-         semw++;
+         if (stop) {
+             /* give back a chunk taken ahead */
+             if (nxt >= 0)
+                 sem_post(sems[nxt]);
+             break;
+         }
+         cur = (cur+1) % nseg;
+      }
+      if (fo != NULL)
+          fanout_close(fo, 1000);
+      if (oring != NULL)
+          uring_close(oring);
+      if (mc != NULL)
+          mcast_close(mc);
+      if (clk != NULL) {
+          if (verbose)
+              clocksync_report(clk);
+          clocksync_close(clk);
+      }
+      if (verbose) {
+          sendreport(connfd);
+          shmreport();
+          pace_report(&pc);
       }
       close(connfd);
       shutdown(listenfd, SHUT_RDWR);
@@ -625,83 +1922,211 @@ int main(int argc, char *argv[])
 
     /* interval mode */
     if (interval) {
+       if (nibufs > 1) {
+           /* buffer 0 is the one allocated above */
+           ib.n = nibufs;
+           ib.ifd = ifd;
+           ib.size = 2*hlen;
+           ib.ilen = ilen;
+           ib.buf = malloc(nibufs*sizeof(char*));
+           ib.len = malloc(nibufs*sizeof(long));
+           ib.last = malloc(nibufs*sizeof(int));
+           ib.empty = malloc(nibufs*sizeof(sem_t));
+           ib.full = malloc(nibufs*sizeof(sem_t));
+           if (!ib.buf || !ib.len || !ib.last || !ib.empty || !ib.full) {
+               fprintf(stderr, "bufhrt: Cannot allocate interval buffers.\n");
+               exit(6);
+           }
+           for (k = 0; k < nibufs; k++) {
+               if (k == 0)
+                   ib.buf[k] = buf;
+               else if (! (ib.buf[k] = malloc(ib.size)) ) {
+                   fprintf(stderr, "bufhrt: Cannot allocate %d buffers of "
+                                   "length %ld.\n", nibufs, ib.size);
+                   exit(6);
+               }
+               sem_init(ib.empty+k, 0, 1);
+               sem_init(ib.full+k, 0, 0);
+           }
+           if (pthread_create(&ithread, NULL, intervalreader, &ib) != 0) {
+               fprintf(stderr, "bufhrt: Cannot create reader thread.\n");
+               exit(6);
+           }
+       }
        count = 0;
+       k = 0;
        while (moreinput) {
           count++;
-          /* fill buffer */
-          memclean(buf, 2*hlen);
-          for (iptr = buf; iptr < buf + 2*hlen - ilen; ) {
-              s = read(ifd, iptr, ilen);
-              if (s < 0) {
-                  fprintf(stderr, "bufhrt: Read error.\n");
-                  exit(18);
-              }
-              icount += s;
-              if (s == 0) {
+          if (nibufs > 1) {
+              /* take next buffer filled by the reader thread */
+              sem_wait(ib.full+k);
+              buf = ib.buf[k];
+              iptr = buf + ib.len[k];
+              icount += ib.len[k];
+              if (ib.last[k])
                   moreinput = 0;
-                  break;
+          } else {
+              /* fill buffer */
+              if (zcmin > 0)
+                  zcwait(connfd, 1LL<<62);
+              memclean(buf, 2*hlen);
+              for (iptr = buf; iptr < buf + 2*hlen - ilen; ) {
+                  s = fileread(ifd, iptr, ilen);
+                  if (s < 0) {
+                      fprintf(stderr, "bufhrt: Read error.\n");
+                      exit(18);
+                  }
+                  icount += s;
+                  if (s == 0) {
+                      moreinput = 0;
+                      break;
+                  }
+                  iptr += s;
               }
-              iptr += s;
           }
 
           /* write out */
           optr = buf;
           wnext = (iptr - optr <= olen) ? (iptr - optr) : olen;
-          clock_gettime(CLOCK_MONOTONIC, &mtime);
-          for (lcount=0, off=looperr; optr < iptr; lcount++, off+=looperr) {
+          pace_start(&pc);
+          for (lcount=0; optr < iptr; lcount++) {
               /* once cache is filled and other side is reading we reset time */
-              if (lcount == 50) clock_gettime(CLOCK_MONOTONIC, &mtime);
-              mtime.tv_nsec += nsec;
-              if (mtime.tv_nsec > 999999999) {
-                mtime.tv_nsec -= 1000000000;
-                mtime.tv_sec++;
-              }
+              if (lcount == 50) pace_start(&pc);
+              pace_step(&pc);
               refreshmem((char*)optr, wnext);
               refreshmem((char*)optr, wnext);
               refreshmem((char*)optr, wnext);
-              while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME,
-                                                                 &mtime, NULL)
-                     != 0) ;
               /* write a chunk, this comes first after waking from sleep */
-              s = write(connfd, optr, wnext);
+              s = pace_write(&pc, outwrite, &osink, optr, wnext);
               if (s < 0) {
                   fprintf(stderr, "bufhrt: Write error.\n");
                   exit(15);
               }
               ocount += s;
               optr += s;
-              wnext = olen + wnext - s;
-              if (off >= 1.0) {
-                 off -= 1.0;
-                 wnext++;
-              }
-              if (wnext >= 2*olen) {
+              if (record)
+                  looprec_add(iptr-optr, 0, s);
+              if (looprec_sig && looprec_check())
+                  moreinput = 0;
+              if (ctl != NULL && ctl->seq != ctlseq &&
+                  docontrol(outpersec, &extrabps, &pc,
+                            &verbose, &record, recfile != NULL, lcount,
+                            icount, ocount, iptr-optr, 0, 0))
+                  moreinput = 0;
+              wnext = pace_size(&pc) + wnext - s;
+              if ((under = pace_clamp(&pc, &wnext, 2*olen)) > 0)
                  fprintf(stderr, "bufhrt: Underrun by %ld (%ld sec %ld nsec).\n",
-                           wnext - 2*olen, mtime.tv_sec, mtime.tv_nsec);
-                 wnext = 2*olen-1;
-              }
+                           under, pc.next.tv_sec, pc.next.tv_nsec);
               s = iptr - optr;
               if (s <= wnext) {
                   wnext = s;
               }
           }
+          if (nibufs > 1) {
+              /* give buffer back to the reader thread */
+              if (zcmin > 0)
+                  zcwait(connfd, 1LL<<62);
+              sem_post(ib.empty+k);
+              k = (k+1) % nibufs;
+          }
        }
 
+       if (fo != NULL)
+           fanout_close(fo, 1000);
+       if (oring != NULL)
+           uring_close(oring);
+       if (iring != NULL)
+           uring_close(iring);
+       if (mc != NULL)
+           mcast_close(mc);
+       if (clk != NULL) {
+           if (verbose)
+               clocksync_report(clk);
+           clocksync_close(clk);
+       }
+       if (verbose)
+           sendreport(connfd);
        close(connfd);
        shutdown(listenfd, SHUT_RDWR);
        close(listenfd);
        close(ifd);
-       if (verbose)
+       if (verify)
+           verifyoutput(outfile, verbose);
+       if (verbose) {
            fprintf(stderr, "bufhrt: Intervals: %ld, total bytes: %lld in %lld out.\n",
                             count, icount, ocount);
+           pace_report(&pc);
+       }
        exit(0);
     }
 
+    /* zero copy mode, the kernel moves the data from the input file */
+    if (zerocopy) {
+        if (infile == NULL || fstat(ifd, &sb) == -1 || !S_ISREG(sb.st_mode)) {
+            fprintf(stderr, "bufhrt: --zero-copy needs a regular --file as input.\n");
+            exit(25);
+        }
+        posix_fadvise(ifd, 0, 0, POSIX_FADV_SEQUENTIAL);
+        badwrites = 0;
+        badwritebytes = 0;
+        pace_start(&pc);
+        mstart = pc.next;
+        if (verbose)
+            fprintf(stderr, "bufhrt: Zero copy from file, starting at %ld sec "
+                            "%ld nsec, outsize %ld, interval %ld nsec\n",
+                            pc.next.tv_sec, pc.next.tv_nsec, olen, pc.nsec);
+        for (count=1; 1; count++) {
+            pace_step(&pc);
+            wnext = pace_size(&pc);
+            /* the file offset is advanced by sendfile */
+            s = pace_write(&pc, outwrite, &osink, NULL, wnext);
+            if (s < 0) {
+                fprintf(stderr, "bufhrt: Write error: %s.\n", strerror(errno));
+                exit(15);
+            }
+            if (s == 0)
+                break;    /* done */
+            if (s < wnext) {
+                badwrites++;
+                badwritebytes += (wnext-s);
+                /* the rest is sent in the next loops, unless the file
+                   has ended */
+                if (lseek(ifd, 0, SEEK_CUR) < sb.st_size)
+                    pace_owe(&pc, wnext-s);
+            }
+            icount += s;
+            ocount += s;
+            if (record)
+                looprec_add(0, s, s);
+            if (looprec_sig && looprec_check())
+                break;
+            if (ctl != NULL && ctl->seq != ctlseq &&
+                docontrol(outpersec, &extrabps, &pc, &verbose,
+                          &record, recfile != NULL, count, icount, ocount,
+                          0, 0, badwrites))
+                break;
+        }
+        if (verbose)
+            sendreport(connfd);
+        close(connfd);
+        shutdown(listenfd, SHUT_RDWR);
+        close(listenfd);
+        close(ifd);
+        if (verbose) {
+            fprintf(stderr, "bufhrt: Loops: %ld, total bytes: %lld in %lld out.\n"
+                            "bufhrt: Short writes/bytes %ld/%ld.\n",
+                            count, icount, ocount, badwrites, badwritebytes);
+            pace_report(&pc);
+            cpureport(ocount, &mstart);
+        }
+        return 0;
+    }
+
     /* default mode, no shared memory input and no interval mode */
     /* fill at least half buffer */
     memclean(buf, 2*hlen);
     for (; iptr < buf + 2*hlen - ilen; ) {
-        s = read(ifd, iptr, ilen);
+        s = fileread(ifd, iptr, ilen);
         if (s < 0) {
             fprintf(stderr, "bufhrt: Read error.\n");
             exit(13);
@@ -718,16 +2143,14 @@ int main(int argc, char *argv[])
     else
         wnext = olen;
 
-    if (clock_gettime(CLOCK_MONOTONIC, &mtime) < 0) {
-        fprintf(stderr, "bufhrt: Cannot get monotonic clock.\n");
-        exit(14);
-    }
+    pace_start(&pc);
+    mstart = pc.next;
     if (verbose) {
         fprintf(stderr, "bufhrt: Starting at %ld sec %ld nsec,\n",
-                                           mtime.tv_sec, mtime.tv_nsec);
+                                           pc.next.tv_sec, pc.next.tv_nsec);
         fprintf(stderr,
                 "bufhrt:    insize %ld, outsize %ld, buflen %ld, interval %ld nsec\n",
-                                     ilen, olen, blen+ilen+2*olen, nsec);
+                                     ilen, olen, blen+ilen+wmax, pc.nsec);
     }
 
     /* main loop */
@@ -735,21 +2158,15 @@ int main(int argc, char *argv[])
     badwrites = 0;
     badreadbytes = 0;
     badwritebytes = 0;
-    for (count=1, off=looperr; 1; count++, off+=looperr) {
+    for (count=1; 1; count++) {
         /* once cache is filled and other side is reading we reset time */
-        if (count == 500) clock_gettime(CLOCK_MONOTONIC, &mtime);
-        mtime.tv_nsec += nsec;
-        if (mtime.tv_nsec > 999999999) {
-          mtime.tv_nsec -= 1000000000;
-          mtime.tv_sec++;
-        }
+        if (count == 500) pace_start(&pc);
+        pace_step(&pc);
         refreshmem((char*)optr, wnext);
         refreshmem((char*)optr, wnext);
         refreshmem((char*)optr, wnext);
-        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &mtime, NULL)
-               != 0) ;
         /* write a chunk, this comes first after waking from sleep */
-        s = write(connfd, optr, wnext);
+        s = pace_write(&pc, outwrite, &osink, optr, wnext);
         if (s < 0) {
             fprintf(stderr, "bufhrt: Write error.\n");
             exit(15);
@@ -760,27 +2177,48 @@ int main(int argc, char *argv[])
         }
         ocount += s;
         optr += s;
-        wnext = olen + wnext - s;
-        if (off >= 1.0) {
-           off -= 1.0;
-           wnext++;
-        }
-        if (wnext >= 2*olen) {
+        wr = s;
+        wnext = pace_size(&pc) + wnext - s;
+        if ((under = pace_clamp(&pc, &wnext, wmax)) > 0)
            fprintf(stderr, "bufhrt: Underrun by %ld (%ld sec %ld nsec).\n",
-                     wnext - 2*olen, mtime.tv_sec, mtime.tv_nsec);
-           wnext = 2*olen-1;
-        }
+                     under, pc.next.tv_sec, pc.next.tv_nsec);
         s = (iptr >= optr ? iptr - optr : iptr+blen-optr);
         if (s <= wnext) {
+            /* the input is late (e.g., an io_uring read still in flight),
+               with --catch-up the missing bytes are written later */
+            if (moreinput && s < wnext) {
+                pc.underruns++;
+                pc.underunits += wnext - s;
+                pace_missed(&pc, wnext - s);
+            }
             wnext = s;
         }
         if (optr+wnext >= max) {
             optr -= blen;
         }
-        /* read if buffer not half filled */
-        if (moreinput && (iptr > optr ? iptr-optr : iptr+blen-optr) < hlen) {
+        /* read if buffer not half filled (only every readloops loops) */
+        rd = 0;
+        if (moreinput && count % readloops == 0 &&
+            (iptr > optr ? iptr-optr : iptr+blen-optr) < hlen) {
+            /* this part of the buffer may still be used by the kernel */
+            if (zcmin > 0)
+                zcwait(connfd, icount + ilen - blen);
             memclean(iptr, ilen);
-            s = read(ifd, iptr, ilen);
+            /* with io_uring we do not wait for the disk, if nothing has
+               arrived yet this counts as a bad read */
+            pending = 0;
+            if (iring != NULL) {
+                s = uring_read(iring, iptr, ilen, 0);
+                if (s < 0 && errno == EAGAIN) {
+                    s = 0;
+                    pending = 1;
+                }
+            } else
+                s = read(ifd, iptr, ilen);
+            if (verify && s > 0)
+                crcin = crc32c(crcin, iptr, s);
+            rd = s;
+            nreads++;
             if (s < 0) {
                 fprintf(stderr, "bufhrt: Read error.\n");
                 exit(16);
@@ -792,25 +2230,61 @@ int main(int argc, char *argv[])
             icount += s;
             iptr += s;
             if (iptr >= max) {
-                memcpy(buf-2*olen, max-2*olen, iptr-max+2*olen);
+                memcpy(buf-wmax, max-wmax, iptr-max+wmax);
                 iptr -= blen;
             }
-            if (s == 0) { /* input complete */
+            if (s == 0 && !pending) { /* input complete */
                 moreinput = 0;
             }
         }
-        if (wnext == 0)
-            break;    /* done */
+        if (record)
+            looprec_add(iptr >= optr ? iptr-optr : iptr+blen-optr, rd, wr);
+        if (looprec_sig && looprec_check())
+            moreinput = 0;
+        if (ctl != NULL && ctl->seq != ctlseq &&
+            docontrol(outpersec, &extrabps, &pc, &verbose,
+                      &record, recfile != NULL, count, icount, ocount,
+                      iptr >= optr ? iptr-optr : iptr+blen-optr,
+                      badreads, badwrites))
+            moreinput = 0;
+        if ((fbnet || fbctl != NULL) && count % fbloops == 0 &&
+            getfeedback(connfd, outpersec, &fbfill, &fbdrift))
+            dofeedback(outpersec, &extrabps, &pc, verbose,
+                       fbfill, fbdrift);
+        /* done, unless we only wait for the input */
+        if (wnext == 0 && !moreinput)
+            break;
+    }
+    if (fo != NULL)
+        fanout_close(fo, 1000);
+    if (oring != NULL)
+        uring_close(oring);
+    if (iring != NULL)
+        uring_close(iring);
+    if (mc != NULL)
+        mcast_close(mc);
+    if (clk != NULL) {
+        if (verbose)
+            clocksync_report(clk);
+        clocksync_close(clk);
     }
+    if (verbose)
+        sendreport(connfd);
     close(connfd);
     shutdown(listenfd, SHUT_RDWR);
     close(listenfd);
     close(ifd);
-    if (verbose)
+    if (verify)
+        verifyoutput(outfile, verbose);
+    if (verbose) {
         fprintf(stderr, "bufhrt: Loops: %ld, total bytes: %lld in %lld out.\n"
-                        "bufhrt: Bad reads/bytes %ld/%ld and writes/bytes %ld/%ld.\n",
+                        "bufhrt: Bad reads/bytes %ld/%ld and writes/bytes %ld/%ld.\n"
+                        "bufhrt: Reads in loop: %lld.\n",
                         count, icount, ocount, badreads, badreadbytes,
-                        badwrites, badwritebytes);
+                        badwrites, badwritebytes, nreads);
+        pace_report(&pc);
+        cpureport(ocount, &mstart);
+    }
     return 0;
 }
 
@@ -176,7 +176,7 @@ int main(int argc, char *argv[])
                exit(20);
            }
            /* also semaphore for write lock */
-           tmpnames[i-optind] = (char*)malloc(strlen(argv[i])+5);
+           tmpnames[i-optind] = (char*)calloc(strlen(argv[i])+5, 1);
            strncpy(tmpnames[i-optind], fnames[i-optind], strlen(argv[i]));
            strncat(tmpnames[i-optind], ".TMP", 4);
            if ((semsw[i-optind] = sem_open(tmpnames[i-optind], O_RDWR))
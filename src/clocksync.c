@@ -0,0 +1,372 @@
+/*
+clocksync.c                Copyright frankl 2017
+
+This file is part of frankl's stereo utilities.
+See the file License.txt of the distribution and
+http://www.gnu.org/licenses/gpl.txt for license details.
+
+Shared timeline of 'bufhrt' and several 'playhrt', see clocksync.h.
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <math.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include "clocksync.h"
+
+static long long now_real()
+{
+    struct timespec t;
+
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec*1000000000LL + t.tv_nsec;
+}
+
+/* our clock, with the artificial offset and rate difference */
+static long long tofake(struct clocksync *cs, long long t)
+{
+    if (cs->inppm == 0.0)
+        return t + cs->inoff;
+    return t + cs->inoff + llround((t - cs->in0)*cs->inppm*1e-6);
+}
+
+static long long toreal(struct clocksync *cs, long long t)
+{
+    if (cs->inppm == 0.0)
+        return t - cs->inoff;
+    return cs->in0 + llround((t - cs->inoff - cs->in0)/(1.0+cs->inppm*1e-6));
+}
+
+static struct clocksync *clocksync_new(char *prog, char *inject,
+                                       int verbose)
+{
+    struct clocksync *cs;
+    char *p;
+
+    if (! (cs = calloc(1, sizeof(struct clocksync)))) {
+        fprintf(stderr, "%s: Cannot allocate clock sync.\n", prog);
+        exit(90);
+    }
+    cs->prog = prog;
+    cs->verbose = verbose;
+    cs->in0 = now_real();
+    if (inject != NULL) {
+        cs->inoff = atoll(inject);
+        if ((p = strchr(inject, ':')) != NULL)
+            cs->inppm = atof(p+1);
+    }
+    cs->delaymin = -1;
+    pthread_mutex_init(&cs->lock, NULL);
+    cs->fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (cs->fd == -1) {
+        fprintf(stderr, "%s: Cannot open clock sync socket.\n", prog);
+        exit(90);
+    }
+    return cs;
+}
+
+static void clocksync_thread(struct clocksync *cs, void *(*fun)(void*))
+{
+    struct timeval tv;
+
+    /* the threads check cs->stop after a timeout */
+    tv.tv_sec = 0;
+    tv.tv_usec = 100000;
+    setsockopt(cs->fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    if (pthread_create(&cs->thread, NULL, fun, cs) != 0) {
+        fprintf(stderr, "%s: Cannot start clock sync thread.\n", cs->prog);
+        exit(92);
+    }
+}
+
+/* master: answer requests as fast as possible */
+static void *masterloop(void *arg)
+{
+    struct clocksync *cs = arg;
+    struct syncmsg m;
+    struct sockaddr_in from;
+    socklen_t flen;
+    long long t2;
+    ssize_t s;
+
+    while (!cs->stop) {
+        flen = sizeof(from);
+        s = recvfrom(cs->fd, &m, sizeof(m), 0, (struct sockaddr*)&from,
+                     &flen);
+        t2 = tofake(cs, now_real());
+        if (s != sizeof(m) || m.magic != CLOCKSYNC_MAGIC)
+            continue;
+        m.t2 = t2;
+        pthread_mutex_lock(&cs->lock);
+        m.refbytes = cs->refbytes;
+        m.reftime = cs->reftime;
+        m.refrate = cs->refrate;
+        cs->requests++;
+        pthread_mutex_unlock(&cs->lock);
+        m.t3 = tofake(cs, now_real());
+        sendto(cs->fd, &m, sizeof(m), 0, (struct sockaddr*)&from, flen);
+    }
+    return NULL;
+}
+
+struct clocksync *clocksync_master(char *prog, char *port, char *inject,
+                                   int verbose)
+{
+    struct clocksync *cs;
+    struct sockaddr_in addr;
+    int optval = 1;
+
+    cs = clocksync_new(prog, inject, verbose);
+    cs->master = 1;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(atoi(port));
+    setsockopt(cs->fd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(int));
+    if (bind(cs->fd, (struct sockaddr*)&addr, sizeof(addr)) == -1) {
+        fprintf(stderr, "%s: Cannot bind clock sync port %s: %s.\n", prog,
+                port, strerror(errno));
+        exit(91);
+    }
+    clocksync_thread(cs, masterloop);
+    return cs;
+}
+
+/* master: bytes of the stream written up to the loop at time t */
+void clocksync_mark(struct clocksync *cs, long long bytes,
+                    struct timespec *t, double bytespersec)
+{
+    long long ft;
+
+    ft = tofake(cs, t->tv_sec*1000000000LL + t->tv_nsec);
+    pthread_mutex_lock(&cs->lock);
+    cs->refbytes = bytes;
+    cs->reftime = ft;
+    cs->refrate = bytespersec/(1.0+cs->inppm*1e-6);
+    pthread_mutex_unlock(&cs->lock);
+}
+
+/* slave: fit a line through the offsets of the last points */
+static void fit(struct clocksync *cs)
+{
+    int i, n, last;
+    double x, y, sx, sy, sxx, sxy, b;
+
+    n = cs->points < CLOCKSYNC_POINTS ? cs->points : CLOCKSYNC_POINTS;
+    last = (cs->points-1) % CLOCKSYNC_POINTS;
+    b = 0.0;
+    y = 0.0;
+    if (n >= 4) {
+        sx = sy = sxx = sxy = 0.0;
+        for (i = 0; i < n; i++) {
+            x = cs->ptime[i] - cs->ptime[last];
+            y = cs->poff[i] - cs->poff[last];
+            sx += x;
+            sy += y;
+            sxx += x*x;
+            sxy += x*y;
+        }
+        if (n*sxx - sx*sx > 0.0)
+            b = (n*sxy - sx*sy)/(n*sxx - sx*sx);
+        /* value of the line at the last point */
+        y = (sy - b*sx)/n;
+    }
+    pthread_mutex_lock(&cs->lock);
+    cs->off = cs->poff[last] + llround(y);
+    cs->tref = cs->ptime[last];
+    cs->drift = b;
+    if (cs->points >= 4)
+        cs->synced = 1;
+    pthread_mutex_unlock(&cs->lock);
+}
+
+static void exchange(struct clocksync *cs, struct syncmsg *m, long long t4)
+{
+    long long delay, off;
+
+    delay = (t4 - m->t1) - (m->t3 - m->t2);
+    off = ((m->t2 - m->t1) + (m->t3 - t4))/2;
+    pthread_mutex_lock(&cs->lock);
+    cs->answers++;
+    cs->delaysum += delay;
+    if (cs->delaymin < 0 || delay < cs->delaymin)
+        cs->delaymin = delay;
+    if (delay > cs->delaymax)
+        cs->delaymax = delay;
+    cs->refbytes = m->refbytes;
+    cs->reftime = m->reftime;
+    cs->refrate = m->refrate;
+    pthread_mutex_unlock(&cs->lock);
+    /* of 4 exchanges we take the one with the smallest delay */
+    if (cs->nbest == 0 || delay < cs->bestdelay) {
+        cs->best = off;
+        cs->besttime = m->t1 + (t4 - m->t1)/2;
+        cs->bestdelay = delay;
+    }
+    if (++cs->nbest == 4) {
+        cs->ptime[cs->points % CLOCKSYNC_POINTS] = cs->besttime;
+        cs->poff[cs->points % CLOCKSYNC_POINTS] = cs->best;
+        cs->points++;
+        cs->nbest = 0;
+        fit(cs);
+    }
+}
+
+static void *slaveloop(void *arg)
+{
+    struct clocksync *cs = arg;
+    struct syncmsg m, a;
+    struct timespec pause;
+    unsigned int seq;
+    ssize_t s;
+
+    for (seq = 1; !cs->stop; seq++) {
+        memset(&m, 0, sizeof(m));
+        m.magic = CLOCKSYNC_MAGIC;
+        m.seq = seq;
+        cs->requests++;
+        m.t1 = tofake(cs, now_real());
+        if (send(cs->fd, &m, sizeof(m), 0) == sizeof(m)) {
+            /* wait for the answer to this request */
+            while ((s = recv(cs->fd, &a, sizeof(a), 0)) >= 0) {
+                if (s == sizeof(a) && a.magic == CLOCKSYNC_MAGIC &&
+                    a.seq == seq) {
+                    exchange(cs, &a, tofake(cs, now_real()));
+                    break;
+                }
+            }
+            if (s < 0)
+                cs->lost++;
+        } else
+            cs->lost++;
+        pause.tv_sec = 0;
+        pause.tv_nsec = cs->points < 8 ? 20000000 : 250000000;
+        nanosleep(&pause, NULL);
+    }
+    return NULL;
+}
+
+struct clocksync *clocksync_slave(char *prog, char *hostport, char *inject,
+                                  int verbose)
+{
+    struct clocksync *cs;
+    struct addrinfo hints, *res;
+    char buf[200], *p, *q;
+
+    cs = clocksync_new(prog, inject, verbose);
+    strncpy(buf, hostport, 199);
+    buf[199] = '\0';
+    if ((p = strrchr(buf, ':')) == NULL) {
+        fprintf(stderr, "%s: Clock master must be given as host:port.\n",
+                prog);
+        exit(90);
+    }
+    *p++ = '\0';
+    cs->delay = 200000000LL;
+    /* host:port:msec */
+    if ((q = strrchr(buf, ':')) != NULL) {
+        *q++ = '\0';
+        cs->delay = atoll(p)*1000000LL;
+        p = q;
+    }
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_DGRAM;
+    if (getaddrinfo(buf, p, &hints, &res) != 0 ||
+        connect(cs->fd, res->ai_addr, res->ai_addrlen) == -1) {
+        fprintf(stderr, "%s: Cannot reach clock master %s.\n", prog,
+                hostport);
+        exit(91);
+    }
+    freeaddrinfo(res);
+    clocksync_thread(cs, slaveloop);
+    return cs;
+}
+
+/* slave: wait until the offset is known and the master is sending */
+int clocksync_wait(struct clocksync *cs, int msec)
+{
+    struct timespec pause;
+    int ok;
+
+    pause.tv_sec = 0;
+    pause.tv_nsec = 10000000;
+    for (; msec > 0; msec -= 10) {
+        pthread_mutex_lock(&cs->lock);
+        ok = cs->synced && cs->refrate > 0.0;
+        pthread_mutex_unlock(&cs->lock);
+        if (ok)
+            return 1;
+        nanosleep(&pause, NULL);
+    }
+    return 0;
+}
+
+/* slave: convert a time of the local CLOCK_MONOTONIC to master time, or
+   back; this is the pace_clock hook of the timed loop */
+void clocksync_convert(void *arg, struct timespec *t, int tolocal)
+{
+    struct clocksync *cs = arg;
+    long long off, tref, x;
+    double drift;
+
+    pthread_mutex_lock(&cs->lock);
+    off = cs->off;
+    tref = cs->tref;
+    drift = cs->drift;
+    pthread_mutex_unlock(&cs->lock);
+    x = t->tv_sec*1000000000LL + t->tv_nsec;
+    if (tolocal)
+        x = toreal(cs, tref + llround((x - off - tref)/(1.0+drift)));
+    else {
+        x = tofake(cs, x);
+        x = x + off + llround(drift*(x - tref));
+    }
+    t->tv_sec = x/1000000000LL;
+    t->tv_nsec = x%1000000000LL;
+}
+
+/* slave: master time at which byte pos of the stream is written */
+long long clocksync_playtime(struct clocksync *cs, long long pos)
+{
+    long long t;
+
+    pthread_mutex_lock(&cs->lock);
+    t = cs->reftime + llround((pos - cs->refbytes)*1e9/cs->refrate) +
+        cs->delay;
+    pthread_mutex_unlock(&cs->lock);
+    return t;
+}
+
+void clocksync_report(struct clocksync *cs)
+{
+    pthread_mutex_lock(&cs->lock);
+    if (cs->master)
+        fprintf(stderr, "%s: Clock master: %lld requests answered.\n",
+                cs->prog, cs->requests);
+    else
+        fprintf(stderr, "%s: Clock sync: %lld requests, %lld answers (%lld "
+                        "lost), delay min/avg/max %.1f/%.1f/%.1f usec, "
+                        "offset %.3f msec, rate %+.3f ppm.\n", cs->prog,
+                        cs->requests, cs->answers, cs->lost,
+                        cs->delaymin/1000.0, cs->answers > 0 ?
+                        cs->delaysum/1000.0/cs->answers : 0.0,
+                        cs->delaymax/1000.0, cs->off/1000000.0,
+                        cs->drift*1e6);
+    pthread_mutex_unlock(&cs->lock);
+}
+
+void clocksync_close(struct clocksync *cs)
+{
+    cs->stop = 1;
+    pthread_join(cs->thread, NULL);
+    close(cs->fd);
+}
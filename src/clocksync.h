@@ -0,0 +1,91 @@
+/*
+clocksync.h                Copyright frankl 2017
+
+This file is part of frankl's stereo utilities.
+See the file License.txt of the distribution and
+http://www.gnu.org/licenses/gpl.txt for license details.
+
+A shared timeline for several 'playhrt' programs (rooms) which receive
+the same --multicast stream of 'bufhrt' (options --clock-master and
+--clock-sync).
+
+'bufhrt' answers timestamp requests on a UDP port (in a separate
+thread). Each 'playhrt' sends a request every 250 msec (at the start
+every 20 msec) and gets four timestamps as in PTP: t1 request sent
+(local clock), t2 received and t3 answer sent (clock of the master), t4
+answer received (local clock). Then the offset of the master clock is
+((t2-t1)+(t3-t4))/2 and the round trip delay is (t4-t1)-(t3-t2). Of
+four exchanges the one with the smallest delay is used; a line is
+fitted through the last 32 of these offsets, so the rate difference of
+the clocks is estimated as well.
+
+The answers also contain a reference of the stream: the number of bytes
+written by 'bufhrt' up to a loop, the time of that loop and the bytes
+per second (all in master time). So each 'playhrt' knows when a byte of
+the stream was sent; it writes it a fixed delay later. Its loop is timed
+in master time, the wakeup times are converted to the local clock (see
+the pace_clock hook in pacing.h).
+
+The slave is given as "host:port[:msec]", msec is the delay (default
+200); the input buffers (e.g., --in-net-buffer-size) must hold the data
+of this time.
+
+For tests on a single machine an artificial offset (in nsec) and rate
+difference (in ppm) can be added to the clock of each program, given as
+"nsec[:ppm]".
+
+All fields of the messages are in the byte order of the sender.
+*/
+
+#include <pthread.h>
+#include <time.h>
+
+#define CLOCKSYNC_MAGIC 0x31595343   /* "CSY1" */
+#define CLOCKSYNC_POINTS 32
+
+struct syncmsg {
+    unsigned int magic;
+    unsigned int seq;
+    long long t1, t2, t3;        /* nsec */
+    /* stream reference of the master */
+    long long refbytes, reftime;
+    double refrate;              /* bytes per second */
+};
+
+struct clocksync {
+    char *prog;
+    int fd;
+    int verbose;
+    int master;
+    int stop;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    /* artificial offset and rate difference of our clock */
+    long long inoff, in0;
+    double inppm;
+    /* master: the stream reference, slave: the one of the last answer */
+    long long refbytes, reftime;
+    double refrate;
+    long long delay;             /* slave: bytes are written this later */
+    /* slave: master time = local + off + drift*(local - tref) */
+    long long off, tref;
+    double drift;
+    int points, synced;
+    long long ptime[CLOCKSYNC_POINTS], poff[CLOCKSYNC_POINTS];
+    long long best, besttime, bestdelay;
+    int nbest;
+    /* statistics */
+    long long requests, answers, lost, delaysum, delaymin, delaymax;
+};
+
+struct clocksync *clocksync_master(char *prog, char *port, char *inject,
+                                   int verbose);
+void clocksync_mark(struct clocksync *cs, long long bytes,
+                    struct timespec *t, double bytespersec);
+struct clocksync *clocksync_slave(char *prog, char *hostport, char *inject,
+                                  int verbose);
+int clocksync_wait(struct clocksync *cs, int msec);
+void clocksync_convert(void *arg, struct timespec *t, int tolocal);
+long long clocksync_playtime(struct clocksync *cs, long long pos);
+void clocksync_report(struct clocksync *cs);
+void clocksync_close(struct clocksync *cs);
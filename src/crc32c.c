@@ -0,0 +1,167 @@
+/*
+crc32c.c                Copyright frankl 2017
+
+This file is part of frankl's stereo utilities.
+See the file License.txt of the distribution and
+http://www.gnu.org/licenses/gpl.txt for license details.
+
+CRC32C checksums, see crc32c.h.
+*/
+
+#include <stdint.h>
+#include <string.h>
+#include "crc32c.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <nmmintrin.h>
+#define CRC_X86
+#elif defined(__aarch64__)
+#include <sys/auxv.h>
+#include <arm_acle.h>
+#ifndef HWCAP_CRC32
+#define HWCAP_CRC32 (1 << 7)
+#endif
+#define CRC_ARM64
+#endif
+
+/* reflected polynomial */
+#define POLY 0x82f63b78
+
+static uint32_t table[8][256];
+
+static uint32_t crc_table(uint32_t crc, const unsigned char *p, size_t len)
+{
+    uint32_t lo, hi;
+
+    while (len > 0 && ((uintptr_t)p & 7) != 0) {
+        crc = table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+        len--;
+    }
+    while (len >= 8) {
+        /* little endian only, see crc32c_init */
+        memcpy(&lo, p, 4);
+        memcpy(&hi, p+4, 4);
+        lo ^= crc;
+        crc = table[7][lo & 0xff] ^ table[6][(lo >> 8) & 0xff] ^
+              table[5][(lo >> 16) & 0xff] ^ table[4][lo >> 24] ^
+              table[3][hi & 0xff] ^ table[2][(hi >> 8) & 0xff] ^
+              table[1][(hi >> 16) & 0xff] ^ table[0][hi >> 24];
+        p += 8;
+        len -= 8;
+    }
+    while (len > 0) {
+        crc = table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+        len--;
+    }
+    return crc;
+}
+
+#ifdef CRC_X86
+__attribute__((target("sse4.2")))
+static uint32_t crc_hw(uint32_t crc, const unsigned char *p, size_t len)
+{
+    while (len > 0 && ((uintptr_t)p & 7) != 0) {
+        crc = _mm_crc32_u8(crc, *p++);
+        len--;
+    }
+#ifdef __x86_64__
+    while (len >= 8) {
+        crc = (uint32_t)_mm_crc32_u64(crc, *(const uint64_t*)p);
+        p += 8;
+        len -= 8;
+    }
+#endif
+    while (len >= 4) {
+        crc = _mm_crc32_u32(crc, *(const uint32_t*)p);
+        p += 4;
+        len -= 4;
+    }
+    while (len > 0) {
+        crc = _mm_crc32_u8(crc, *p++);
+        len--;
+    }
+    return crc;
+}
+#endif
+
+#ifdef CRC_ARM64
+__attribute__((target("+crc")))
+static uint32_t crc_hw(uint32_t crc, const unsigned char *p, size_t len)
+{
+    while (len > 0 && ((uintptr_t)p & 7) != 0) {
+        crc = __crc32cb(crc, *p++);
+        len--;
+    }
+    while (len >= 8) {
+        crc = __crc32cd(crc, *(const uint64_t*)p);
+        p += 8;
+        len -= 8;
+    }
+    while (len > 0) {
+        crc = __crc32cb(crc, *p++);
+        len--;
+    }
+    return crc;
+}
+#endif
+
+static uint32_t (*crcfun)(uint32_t, const unsigned char*, size_t) = NULL;
+static char *implname;
+
+static void crc32c_init()
+{
+    uint32_t c;
+    int i, k;
+
+    for (i = 0; i < 256; i++) {
+        for (c = i, k = 0; k < 8; k++)
+            c = (c & 1) ? (c >> 1) ^ POLY : c >> 1;
+        table[0][i] = c;
+    }
+    for (i = 0; i < 256; i++)
+        for (k = 1; k < 8; k++)
+            table[k][i] = table[0][table[k-1][i] & 0xff] ^
+                          (table[k-1][i] >> 8);
+    crcfun = crc_table;
+    implname = "table";
+#if __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+    /* the slicing above assumes little endian words, on other machines we
+       use it with the byte loop only */
+    crcfun = NULL;
+    implname = "bytewise table";
+#endif
+#ifdef CRC_X86
+    if (__builtin_cpu_supports("sse4.2")) {
+        crcfun = crc_hw;
+        implname = "SSE4.2";
+    }
+#endif
+#ifdef CRC_ARM64
+    if (getauxval(AT_HWCAP) & HWCAP_CRC32) {
+        crcfun = crc_hw;
+        implname = "ARMv8 CRC";
+    }
+#endif
+}
+
+unsigned int crc32c(unsigned int crc, const void *buf, size_t len)
+{
+    const unsigned char *p = buf;
+
+    if (implname == NULL)
+        crc32c_init();
+    crc = ~crc;
+    if (crcfun != NULL)
+        crc = crcfun(crc, p, len);
+    else
+        while (len-- > 0)
+            crc = table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    return ~crc;
+}
+
+char *crc32c_impl()
+{
+    if (implname == NULL)
+        crc32c_init();
+    return implname;
+}
@@ -0,0 +1,23 @@
+/*
+crc32c.h                Copyright frankl 2017
+
+This file is part of frankl's stereo utilities.
+See the file License.txt of the distribution and
+http://www.gnu.org/licenses/gpl.txt for license details.
+
+CRC32C (Castagnoli) checksums, used by 'bufhrt --verify'. The CRC
+instructions of the CPU are used if available (SSE4.2 on x86, the CRC
+extension on 64-bit ARM), this is checked at runtime. Otherwise a table
+driven version is used (slicing by 8 bytes).
+
+The checksum of a stream is computed piecewise:
+    crc = 0;
+    crc = crc32c(crc, buf1, len1);
+    crc = crc32c(crc, buf2, len2); ...
+*/
+
+#include <sys/types.h>
+
+unsigned int crc32c(unsigned int crc, const void *buf, size_t len);
+/* name of the implementation in use */
+char *crc32c_impl();
@@ -0,0 +1,141 @@
+/*
+ctlpage.c                Copyright frankl 2017
+
+This file is part of frankl's stereo utilities.
+See the file License.txt of the distribution and
+http://www.gnu.org/licenses/gpl.txt for license details.
+
+A small page of shared memory to control a running 'playhrt' or 'bufhrt'
+(e.g., with 'hrtctl'). The program checks in each loop if the sequence
+number in the first cache line was changed.
+'playhrt' also publishes its current output latency in each loop.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include "ctlpage.h"
+
+static char *ctlname = NULL;
+
+static void ctlpage_unlink(void) {
+  if (ctlname != NULL)
+     shm_unlink(ctlname);
+}
+
+/* create the page, it is removed when the program exits; the page of
+   another running program with the same name is not taken over */
+struct ctlpage* ctlpage_open(char *prog, char *name) {
+  int fd;
+  struct ctlpage *ctl;
+
+  if ((fd = shm_open(name, O_CREAT | O_RDWR, S_IRUSR | S_IWUSR)) == -1) {
+     fprintf(stderr, "%s: Cannot open control page %s.\n", prog, name);
+     exit(41);
+  }
+  if (ftruncate(fd, sizeof(struct ctlpage)) == -1) {
+     fprintf(stderr, "%s: Cannot truncate control page %s.\n", prog, name);
+     exit(41);
+  }
+  ctl = mmap(NULL, sizeof(struct ctlpage), PROT_READ | PROT_WRITE,
+             MAP_SHARED, fd, 0);
+  close(fd);
+  if (ctl == MAP_FAILED) {
+     fprintf(stderr, "%s: Cannot map control page %s.\n", prog, name);
+     exit(41);
+  }
+  if (ctl->magic == CTL_MAGIC && ctl->pid > 0 && ctl->pid != getpid() &&
+      (kill(ctl->pid, 0) == 0 || errno == EPERM)) {
+     fprintf(stderr, "%s: Control page %s is used by process %d.\n", prog,
+             name, ctl->pid);
+     exit(41);
+  }
+  memset(ctl, 0, sizeof(struct ctlpage));
+  ctl->magic = CTL_MAGIC;
+  ctl->version = CTL_VERSION;
+  ctl->pid = getpid();
+  ctlname = name;
+  atexit(ctlpage_unlink);
+  return ctl;
+}
+
+/* map the page of a running program, returns NULL in case of problem */
+struct ctlpage* ctlpage_attach(char *prog, char *name) {
+  int fd;
+  struct ctlpage *ctl;
+
+  if ((fd = shm_open(name, O_RDWR, S_IRUSR | S_IWUSR)) == -1) {
+     fprintf(stderr, "%s: Cannot open control page %s.\n", prog, name);
+     return NULL;
+  }
+  ctl = mmap(NULL, sizeof(struct ctlpage), PROT_READ | PROT_WRITE,
+             MAP_SHARED, fd, 0);
+  close(fd);
+  if (ctl == MAP_FAILED || ctl->magic != CTL_MAGIC ||
+      ctl->version != CTL_VERSION) {
+     fprintf(stderr, "%s: No valid control page %s.\n", prog, name);
+     return NULL;
+  }
+  return ctl;
+}
+
+/* get and clear the pending command bits, remember sequence number */
+unsigned int ctlpage_cmd(struct ctlpage *ctl, unsigned int *seq) {
+  *seq = ctl->seq;
+  return __sync_fetch_and_and(&ctl->cmd, 0);
+}
+
+/* call after filling in the statistics */
+void ctlpage_snapdone(struct ctlpage *ctl, unsigned int seq) {
+  __sync_synchronize();
+  ctl->snapseq = seq;
+}
+
+
+/* publish the current output latency: hwdelay frames in the sound device
+   and buffered frames in memory of the program at given time */
+void ctlpage_setlatency(struct ctlpage *ctl, long long time,
+                        long long hwdelay, long long buffered, int rate) {
+  ctl->latseq++;
+  __sync_synchronize();
+  ctl->rate = rate;
+  ctl->lattime = time;
+  ctl->hwdelay = hwdelay;
+  ctl->buffered = buffered;
+  ctl->latency = (hwdelay+buffered)*1000000000LL/rate;
+  __sync_synchronize();
+  ctl->latseq++;
+}
+
+/* read a consistent set of latency values, returns 0 if the program
+   does not publish them, or if it is stuck in an update (e.g., it was
+   killed in the middle of it) and we gave up after a number of tries */
+#define LATTRIES 10000
+int ctlpage_getlatency(struct ctlpage *ctl, long long *time,
+                       long long *latency, long long *hwdelay,
+                       long long *buffered, int *rate) {
+  unsigned int seq;
+  int tries;
+
+  for (tries = 0; tries < LATTRIES; tries++) {
+    if ((seq = ctl->latseq) & 1)
+      continue;
+    __sync_synchronize();
+    *rate = ctl->rate;
+    *time = ctl->lattime;
+    *latency = ctl->latency;
+    *hwdelay = ctl->hwdelay;
+    *buffered = ctl->buffered;
+    __sync_synchronize();
+    if (ctl->latseq == seq)
+      return seq != 0;
+  }
+  return 0;
+}
@@ -0,0 +1,68 @@
+/*
+ctlpage.h                Copyright frankl 2017
+
+This file is part of frankl's stereo utilities.
+See the file License.txt of the distribution and
+http://www.gnu.org/licenses/gpl.txt for license details.
+
+A small page of shared memory to control a running 'playhrt' or 'bufhrt'
+(e.g., with 'hrtctl'). The program checks in each loop if the sequence
+number in the first cache line was changed.
+'playhrt' also publishes its current output latency in each loop.
+*/
+
+#define CTL_MAGIC   0x4c544348
+#define CTL_VERSION 3
+
+/* command bits */
+#define CTL_EXTRA    1   /* set --extra-bytes-per-second to 'extrabps' */
+#define CTL_VERBOSE  2   /* set verbosity to 'verbose' */
+#define CTL_STATS    4   /* switch statistics on/off with 'stats' */
+#define CTL_SNAPSHOT 8   /* fill in the statistics below */
+#define CTL_STOP     16  /* write out buffered data and stop */
+
+struct ctlpage {
+    /* first cache line, written by the controlling program */
+    volatile unsigned int seq;     /* incremented after each command */
+    volatile unsigned int cmd;     /* command bits, cleared when handled */
+    volatile int verbose;
+    volatile int stats;
+    volatile double extrabps;
+    char pad[40];
+    /* written by 'playhrt' or 'bufhrt' */
+    unsigned int magic;
+    unsigned int version;
+    int pid;
+    volatile unsigned int snapseq; /* seq of the last snapshot */
+    long long loops;
+    long long inbytes;
+    long long outbytes;
+    long long delayed;             /* delayed loops (playhrt) */
+    long long badreads;
+    long long badwrites;
+    long long fill;                /* buffer fill, depends on program */
+    long long nsec;                /* current duration of a loop */
+    double curextrabps;            /* current extra bytes per second */
+    /* output latency, written in each loop by 'playhrt', 'latseq' is odd
+       while the values are changed */
+    volatile unsigned int latseq;
+    volatile int rate;
+    volatile long long lattime;    /* CLOCK_MONOTONIC nsec of measurement */
+    volatile long long latency;    /* nsec until a new sample is played */
+    volatile long long hwdelay;    /* frames in sound device */
+    volatile long long buffered;   /* frames in internal buffer */
+    /* connections of 'bufhrt' with --keep-listening, in snapshot */
+    long long connects;
+    long long disconnects;
+};
+
+struct ctlpage* ctlpage_open(char *prog, char *name);
+struct ctlpage* ctlpage_attach(char *prog, char *name);
+unsigned int ctlpage_cmd(struct ctlpage *ctl, unsigned int *seq);
+void ctlpage_snapdone(struct ctlpage *ctl, unsigned int seq);
+void ctlpage_setlatency(struct ctlpage *ctl, long long time,
+                        long long hwdelay, long long buffered, int rate);
+int ctlpage_getlatency(struct ctlpage *ctl, long long *time,
+                       long long *latency, long long *hwdelay,
+                       long long *buffered, int *rate);
+
@@ -0,0 +1,213 @@
+/*
+fanout.c                Copyright frankl 2017
+
+This file is part of frankl's stereo utilities.
+See the file License.txt of the distribution and
+http://www.gnu.org/licenses/gpl.txt for license details.
+
+Serving several network clients from one timed loop, see fanout.h.
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include "fanout.h"
+
+static void fanout_drop(struct fanout *fo, struct fanclient *c, char *why) {
+  if (fo->verbose)
+     fprintf(stderr, "%s: Client %d %s, %lld bytes sent, max. backlog %lld, "
+                     "%d resyncs (%lld bytes skipped).\n", fo->prog, c->nr,
+                     why, c->sent, c->maxlag, c->resyncs, c->skipped);
+  close(c->fd);
+  c->fd = -1;
+  fo->nclients--;
+}
+
+/* the ring is allocated and touched here, so no page faults in the loop */
+struct fanout* fanout_new(char *prog, int listenfd, int maxclients,
+                          long size, int drop, int verbose) {
+  struct fanout *fo;
+  int i;
+
+  if (! (fo = malloc(sizeof(struct fanout))) ||
+      ! (fo->cl = malloc(maxclients*sizeof(struct fanclient))) ||
+      ! (fo->ring = malloc(size)) ) {
+     fprintf(stderr, "%s: Cannot allocate buffer for %d clients.\n",
+             prog, maxclients);
+     exit(50);
+  }
+  memset(fo->ring, 0, size);
+  mlock(fo->ring, size);
+  for (i = 0; i < maxclients; i++)
+     fo->cl[i].fd = -1;
+  fo->prog = prog;
+  fo->listenfd = listenfd;
+  fo->maxclients = maxclients;
+  fo->nclients = 0;
+  fo->nr = 0;
+  fo->drop = drop;
+  fo->verbose = verbose;
+  fo->sndbuf = 0;
+  fo->pacing = 0;
+  fo->size = size;
+  fo->head = 0;
+  return fo;
+}
+
+/* kernel pacing of a client socket (see --kernel-pacing of 'bufhrt'),
+   without a given send buffer size one for about 0.1 seconds */
+static void fanout_pace(struct fanout *fo, int fd) {
+  int sndbuf;
+
+  if (setsockopt(fd, SOL_SOCKET, SO_MAX_PACING_RATE, &fo->pacing,
+                 sizeof(unsigned int)) == -1) {
+     fprintf(stderr, "%s: Cannot set pacing rate: %s.\n", fo->prog,
+             strerror(errno));
+     exit(31);
+  }
+  if (fo->sndbuf == 0) {
+     sndbuf = fo->pacing/10;
+     setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(int));
+  }
+}
+
+/* accept pending connections, with block != 0 wait for one, returns
+   the number of new clients; new clients start with the newest data */
+int fanout_accept(struct fanout *fo, int block) {
+  int fd, i, n;
+
+  for (n = 0; fo->nclients < fo->maxclients; n++) {
+     fd = accept4(fo->listenfd, NULL, NULL, block ? 0 : SOCK_NONBLOCK);
+     if (fd == -1) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+           fprintf(stderr, "%s: Cannot accept connection: %s.\n", fo->prog,
+                   strerror(errno));
+        break;
+     }
+     if (block) {
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+        fcntl(fo->listenfd, F_SETFL,
+              fcntl(fo->listenfd, F_GETFL) | O_NONBLOCK);
+        block = 0;
+     }
+     if (fo->sndbuf != 0)
+        setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &fo->sndbuf, sizeof(int));
+     if (fo->pacing != 0)
+        fanout_pace(fo, fd);
+     for (i = 0; fo->cl[i].fd != -1; i++) ;
+     fo->cl[i].fd = fd;
+     fo->cl[i].nr = ++fo->nr;
+     fo->cl[i].pos = fo->head;
+     fo->cl[i].sent = 0;
+     fo->cl[i].skipped = 0;
+     fo->cl[i].maxlag = 0;
+     fo->cl[i].resyncs = 0;
+     fo->nclients++;
+     if (fo->verbose)
+        fprintf(stderr, "%s: Client %d connected (%d of %d).\n", fo->prog,
+                fo->nr, fo->nclients, fo->maxclients);
+  }
+  return n;
+}
+
+/* new pacing rate for all clients, also used for new ones */
+void fanout_pacing(struct fanout *fo, unsigned int rate) {
+  int i;
+
+  fo->pacing = rate;
+  for (i = 0; i < fo->maxclients; i++)
+     if (fo->cl[i].fd != -1)
+        fanout_pace(fo, fo->cl[i].fd);
+}
+
+/* send as much of the backlog of client c as the socket takes */
+static void fanout_send(struct fanout *fo, struct fanclient *c) {
+  long long lag;
+  long idx, n;
+  ssize_t s;
+
+  while ((lag = fo->head - c->pos) > 0) {
+     idx = c->pos % fo->size;
+     n = (idx + lag > fo->size) ? fo->size - idx : lag;
+     s = send(c->fd, fo->ring + idx, n, MSG_DONTWAIT | MSG_NOSIGNAL);
+     if (s < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+           return;
+        fanout_drop(fo, c, "disconnected");
+        return;
+     }
+     c->pos += s;
+     c->sent += s;
+     if (s < n)
+        return;
+  }
+}
+
+/* append len bytes (at most the size of the ring) and send to all
+   clients, the data are always taken completely */
+long fanout_write(struct fanout *fo, char *ptr, long len) {
+  struct fanclient *c;
+  long idx, n;
+  long long lag;
+  int i;
+
+  idx = fo->head % fo->size;
+  n = (idx + len > fo->size) ? fo->size - idx : len;
+  memcpy(fo->ring + idx, ptr, n);
+  if (n < len)
+     memcpy(fo->ring, ptr + n, len - n);
+  fo->head += len;
+  for (i = 0; i < fo->maxclients; i++) {
+     c = fo->cl + i;
+     if (c->fd == -1)
+        continue;
+     lag = fo->head - c->pos;
+     if (lag > fo->size) {
+        /* the oldest data of this client are overwritten */
+        if (fo->drop) {
+           fanout_drop(fo, c, "too slow, dropped");
+           continue;
+        }
+        c->resyncs++;
+        c->skipped += lag - len;
+        c->pos = fo->head - len;
+        lag = len;
+        if (fo->verbose)
+           fprintf(stderr, "%s: Client %d too slow, resynced.\n", fo->prog,
+                   c->nr);
+     }
+     if (lag > c->maxlag)
+        c->maxlag = lag;
+     fanout_send(fo, c);
+  }
+  if (fo->nclients < fo->maxclients)
+     fanout_accept(fo, 0);
+  return len;
+}
+
+/* send the remaining data (giving up on a client which does not take
+   data for msec milliseconds), then close all connections */
+void fanout_close(struct fanout *fo, int msec) {
+  struct pollfd pfd;
+  int i;
+
+  for (i = 0; i < fo->maxclients; i++) {
+     if (fo->cl[i].fd == -1)
+        continue;
+     pfd.fd = fo->cl[i].fd;
+     pfd.events = POLLOUT;
+     while (fo->cl[i].fd != -1 && fo->cl[i].pos < fo->head &&
+            poll(&pfd, 1, msec) > 0)
+        fanout_send(fo, fo->cl + i);
+     if (fo->cl[i].fd != -1)
+        fanout_drop(fo, fo->cl + i, "finished");
+  }
+}
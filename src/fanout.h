@@ -0,0 +1,45 @@
+/*
+fanout.h                Copyright frankl 2017
+
+This file is part of frankl's stereo utilities.
+See the file License.txt of the distribution and
+http://www.gnu.org/licenses/gpl.txt for license details.
+
+Serving several network clients from one timed loop: the output of each
+loop is appended once to a ring in memory and every client sends from
+its own position in this ring. Clients which fall behind more than the
+size of the ring are resynced (they skip to the newest data) or dropped.
+*/
+
+struct fanclient {
+    int fd;            /* -1 for a free slot */
+    int nr;            /* running number of client, for messages */
+    long long pos;     /* stream position of next byte to send */
+    long long sent;    /* bytes sent */
+    long long skipped; /* bytes skipped by resyncs */
+    long long maxlag;  /* largest backlog seen */
+    int resyncs;
+};
+
+struct fanout {
+    char *prog;
+    int listenfd;
+    int maxclients;
+    int nclients;
+    int nr;            /* number of clients accepted so far */
+    int drop;          /* drop slow clients instead of resyncing them */
+    int verbose;
+    int sndbuf;        /* send buffer size for clients, 0 for default */
+    unsigned int pacing; /* kernel pacing rate for clients, 0 for none */
+    long size;         /* size of ring, also the maximal backlog */
+    char *ring;
+    long long head;    /* stream position after newest byte in ring */
+    struct fanclient *cl;
+};
+
+struct fanout* fanout_new(char *prog, int listenfd, int maxclients,
+                          long size, int drop, int verbose);
+int fanout_accept(struct fanout *fo, int block);
+void fanout_pacing(struct fanout *fo, unsigned int rate);
+long fanout_write(struct fanout *fo, char *ptr, long len);
+void fanout_close(struct fanout *fo, int msec);
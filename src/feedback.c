@@ -0,0 +1,28 @@
+/*
+feedback.c                Copyright frankl 2017
+
+This file is part of frankl's stereo utilities.
+See the file License.txt of the distribution and
+http://www.gnu.org/licenses/gpl.txt for license details.
+
+Receiver driven rate control, see feedback.h.
+*/
+
+#include "feedback.h"
+
+/* the drift is the change of the fill per second, exponentially
+   smoothed over about 10 values */
+void feedback_update(struct fbstate *fb, long long time, long long fill) {
+  double d;
+
+  if (fb->n > 0 && time > fb->time) {
+     d = (fill - fb->fill)*1000000000.0/(time - fb->time);
+     if (fb->n == 1)
+        fb->drift = d;
+     else
+        fb->drift = 0.9*fb->drift + 0.1*d;
+  }
+  fb->time = time;
+  fb->fill = fill;
+  fb->n++;
+}
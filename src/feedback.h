@@ -0,0 +1,32 @@
+/*
+feedback.h                Copyright frankl 2017
+
+This file is part of frankl's stereo utilities.
+See the file License.txt of the distribution and
+http://www.gnu.org/licenses/gpl.txt for license details.
+
+Receiver driven rate control (option --feedback of 'playhrt' and
+'bufhrt'): 'playhrt' sends reports about the fill of its buffers back
+on the network connection, 'bufhrt' adjusts the duration of its loops
+such that this fill stays constant.
+*/
+
+#define FEEDBACK_MAGIC 0x314b4246   /* "FBK1" */
+
+/* report sent by 'playhrt', in byte order of the sender */
+struct feedback {
+    unsigned int magic;
+    unsigned int seq;
+    long long time;      /* CLOCK_MONOTONIC nsec of receiver */
+    long long fill;      /* bytes buffered in sound device and program */
+    double drift;        /* smoothed change of fill in bytes per second */
+};
+
+/* estimation of the drift from a series of fill values */
+struct fbstate {
+    long long time, fill;
+    double drift;
+    long n;
+};
+
+void feedback_update(struct fbstate *fb, long long time, long long fill);
@@ -0,0 +1,27 @@
+/*
+frame.h                Copyright frankl 2017
+
+This file is part of frankl's stereo utilities.
+See the file License.txt of the distribution and
+http://www.gnu.org/licenses/gpl.txt for license details.
+
+Framed network stream (option --framed of 'bufhrt' and 'playhrt'): each
+chunk written by 'bufhrt' is preceded by this header, so that the
+receiver can compute latency and jitter of the chunks and detect gaps.
+All fields are in the byte order of the sender.
+*/
+
+#define FRAME_MAGIC 0x314d5246   /* "FRM1" */
+
+/* clock of the timestamps */
+#define FRAME_MONO  0            /* CLOCK_MONOTONIC, only on same host */
+#define FRAME_TAI   1            /* CLOCK_TAI, hosts synchronized by PTP */
+
+struct framehdr {
+    unsigned int magic;
+    unsigned int len;            /* bytes of data after the header */
+    unsigned int clock;          /* FRAME_MONO or FRAME_TAI */
+    unsigned int pad;
+    unsigned long long seq;      /* counts the frames from 0 */
+    long long tsend;             /* nsec of sending, see clock */
+};
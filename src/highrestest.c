@@ -7,12 +7,97 @@ http://www.gnu.org/licenses/gpl.txt for license details.
 */
 #include <time.h>
 #include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include "hist.h"
+#include "pacing.h"
+
+/* 'highrestest --pacing [rate [loops [extra]]]': compare the old timed
+   loop (rounded nsec steps, a double for the fractional units per loop)
+   with the pacing scheduler over one simulated day, and measure the
+   wakeup times of 5 seconds of real loops */
+static double secs(struct timespec *a, struct timespec *b) {
+  return (b->tv_sec - a->tv_sec) + (b->tv_nsec - a->tv_nsec)*1e-9;
+}
+
+int pacingtest(long long rate, long loops, double extra) {
+  struct pacing pc;
+  struct timespec t0, t1, start;
+  long long n, i, units, oldunits, oldns;
+  long nsec, olen, sz;
+  double looperr, off, exactns, exactunits, tpace, told;
+  volatile long sink = 0;
+
+  pace_init(&pc, "highrestest", rate, loops, extra, 2);
+  n = 86400LL*loops;
+  olen = rate/loops;
+  if (olen <= 0)
+      olen = 1;
+  exactns = 1e9*rate/(rate+extra)/loops*n;
+  exactunits = (double)rate/loops*n;
+
+  /* the old loop */
+  nsec = (long) (1000000000*((double)rate/(rate+extra))/loops);
+  looperr = (1.0*rate)/loops - olen;
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  for (i = 0, oldns = 0, oldunits = 0, off = looperr; i < n;
+       i++, off += looperr) {
+      oldns += nsec;
+      sz = olen;
+      if (off >= 1.0) {
+          off -= 1.0;
+          sz++;
+      }
+      oldunits += sz;
+      sink += sz;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  told = secs(&t0, &t1);
+
+  /* the pacing scheduler */
+  pc.next.tv_sec = 0;
+  pc.next.tv_nsec = 0;
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  for (i = 0, units = 0; i < n; i++) {
+      pace_step(&pc);
+      units += pace_size(&pc);
+  }
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  tpace = secs(&t0, &t1);
+
+  printf("----- Pacing %lld units/sec in %ld loops/sec, extra %.3f, one "
+         "simulated day (%lld loops):\n", rate, loops, extra, n);
+  printf("old:    drift %.0f nsec, %.0f units, %.2f nsec per loop\n",
+         oldns - exactns, oldunits - exactunits, told*1e9/n);
+  printf("pacing: drift %.0f nsec, %.0f units, %.2f nsec per loop\n",
+         pc.next.tv_sec*1e9 + pc.next.tv_nsec - exactns,
+         units - exactunits, tpace*1e9/n);
+
+  /* real loops with wakeup statistics */
+  pace_init(&pc, "highrestest", rate, loops, extra, 2);
+  pace_start(&pc);
+  start = pc.next;
+  for (i = 0; i < 5LL*loops; i++) {
+      pace_step(&pc);
+      pace_sleep(&pc);
+  }
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  printf("----- %lld real loops in %.6f sec:\n", i, secs(&start, &t1));
+  fflush(stdout);
+  pace_report(&pc);
+  return 0;
+}
 
 /* a simple test of the resolution of several CLOCKs */
-int main() {
+int main(int argc, char *argv[]) {
   int ret, highresok;
   struct timespec res, tim;
 
+  if (argc > 1 && strcmp(argv[1], "--pacing") == 0)
+     return pacingtest(argc > 2 ? atoll(argv[2]) : 44100,
+                       argc > 3 ? atol(argv[3]) : 1000,
+                       argc > 4 ? atof(argv[4]) : 0.0);
+
   printf("----- Testing highres timer:\n");
 
   ret = clock_getres(CLOCK_REALTIME, &res);
@@ -0,0 +1,55 @@
+/*
+hist.c                Copyright frankl 2017
+
+This file is part of frankl's stereo utilities.
+See the file License.txt of the distribution and
+http://www.gnu.org/licenses/gpl.txt for license details.
+
+Histograms of time values (in nsec) with buckets of powers of 2 in usec.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include "hist.h"
+
+void hist_init(struct hist *h) {
+  memset(h, 0, sizeof(struct hist));
+  h->min = 1LL<<62;
+}
+
+/* no floating point and no division, cheap enough for every loop */
+void hist_add(struct hist *h, long long nsec) {
+  long long us;
+  int k;
+
+  if (nsec < 0)
+     nsec = 0;
+  h->n++;
+  h->sum += nsec;
+  if (nsec < h->min)
+     h->min = nsec;
+  if (nsec > h->max)
+     h->max = nsec;
+  for (k = 0, us = 1000; nsec >= us && k < HIST_BUCKETS-1; k++, us <<= 1) ;
+  h->b[k]++;
+}
+
+/* print to stderr, empty buckets at both ends are omitted */
+void hist_print(char *prog, char *name, struct hist *h) {
+  int k, first, last;
+
+  if (h->n == 0) {
+     fprintf(stderr, "%s: %s: no values.\n", prog, name);
+     return;
+  }
+  fprintf(stderr, "%s: %s (usec): min %.1f, avg %.1f, max %.1f (%lld values)\n",
+          prog, name, h->min/1000.0, h->sum/1000.0/h->n, h->max/1000.0, h->n);
+  for (first = 0; h->b[first] == 0; first++) ;
+  for (last = HIST_BUCKETS-1; h->b[last] == 0; last--) ;
+  for (k = first; k <= last; k++) {
+     if (k == HIST_BUCKETS-1)
+        fprintf(stderr, "%s:     >= %8ld: %lld\n", prog, 1L<<(k-1), h->b[k]);
+     else
+        fprintf(stderr, "%s:      < %8ld: %lld\n", prog, 1L<<k, h->b[k]);
+  }
+}
@@ -0,0 +1,20 @@
+/*
+hist.h                Copyright frankl 2017
+
+This file is part of frankl's stereo utilities.
+See the file License.txt of the distribution and
+http://www.gnu.org/licenses/gpl.txt for license details.
+
+Histograms of time values (in nsec) with buckets of powers of 2 in usec.
+*/
+
+#define HIST_BUCKETS 24
+
+struct hist {
+    long long n, sum, min, max;
+    long long b[HIST_BUCKETS];   /* b[0]: < 1 usec, b[k]: < 2^k usec */
+};
+
+void hist_init(struct hist *h);
+void hist_add(struct hist *h, long long nsec);
+void hist_print(char *prog, char *name, struct hist *h);
@@ -0,0 +1,194 @@
+/*
+hrtctl.c                Copyright frankl 2017
+
+This file is part of frankl's stereo utilities.
+See the file License.txt of the distribution and
+http://www.gnu.org/licenses/gpl.txt for license details.
+*/
+
+#include "version.h"
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "ctlpage.h"
+
+/* help page */
+/* vim hint to remove resp. add quotes:
+      s/^"\(.*\)\\n"$/\1/
+      s/.*$/"\0\\n"/
+*/
+void usage( ) {
+  fprintf(stderr,
+          "hrtctl (version %s of frankl's stereo utilities)\nUSAGE:\n",
+          VERSION);
+  fprintf(stderr,
+"\n"
+"  hrtctl --shmname=/<name> [options]\n"
+"\n"
+"  This program changes parameters of a running 'playhrt' or 'bufhrt'\n"
+"  which was started with the option --control-shm=/<name>. The running\n"
+"  program checks its control page once per loop, so there is no need\n"
+"  to restart a stream for changing these parameters.\n"
+"\n"
+"  OPTIONS\n"
+"\n"
+"  --shmname=string, -i string\n"
+"      the name of the control page given to 'playhrt' or 'bufhrt'.\n"
+"\n"
+"  --extra-bytes-per-second=floatval, -e floatval\n"
+"      set a new value for the --extra-bytes-per-second parameter, this\n"
+"      changes the duration of the loops.\n"
+"\n"
+"  --set-verbose=intval, -l intval\n"
+"      set the verbosity level of the program (0 is quiet).\n"
+"\n"
+"  --stats=on|off, -t on|off\n"
+"      switch statistics (recording with --record-file, and in\n"
+"      'playhrt' also the buffer and delay statistics) on or off.\n"
+"\n"
+"  --snapshot, -s\n"
+"      print current statistics of the running program.\n"
+"\n"
+"  --latency, -L\n"
+"      print the current output latency of a running 'playhrt': the time\n"
+"      until a sample given to 'playhrt' is played, with the frames\n"
+"      in the sound device and in the internal buffer.\n"
+"\n"
+"  --stop, -x\n"
+"      the program stops reading input, writes out buffered data and\n"
+"      exits ('playhrt' drains the sound device).\n"
+"\n"
+"  --version, -V\n"
+"      print information about the version of the program and abort.\n"
+"\n"
+"  --help, -h\n"
+"      print this help page and abort.\n"
+"\n"
+"  EXAMPLE\n"
+"\n"
+"  bufhrt ... --control-shm=/bufctl ...  &\n"
+"  hrtctl --shmname=/bufctl --extra-bytes-per-second=14 --snapshot\n"
+"\n"
+  );
+}
+
+int main(int argc, char *argv[])
+{
+    char *name;
+    int optc, i, verbose, stats, latency, rate;
+    long long ltime, lat, hwdelay, buffered;
+    unsigned int cmd, seq;
+    double extrabps;
+    struct ctlpage *ctl;
+
+    static struct option longoptions[] = {
+        {"shmname", required_argument, 0, 'i' },
+        {"extra-bytes-per-second", required_argument, 0, 'e' },
+        {"set-verbose", required_argument, 0, 'l' },
+        {"stats", required_argument, 0, 't' },
+        {"snapshot", no_argument, 0, 's' },
+        {"latency", no_argument, 0, 'L' },
+        {"stop", no_argument, 0, 'x' },
+        {"version", no_argument, 0, 'V' },
+        {"help", no_argument, 0, 'h' },
+        {0,         0,                 0,  0 }
+    };
+
+    if (argc == 1) {
+       usage();
+       exit(0);
+    }
+    name = NULL;
+    cmd = 0;
+    extrabps = 0.0;
+    verbose = 0;
+    stats = 0;
+    latency = 0;
+    while ((optc = getopt_long(argc, argv, "i:e:l:t:sLxVh",
+            longoptions, &optind)) != -1) {
+        switch (optc) {
+        case 'i':
+          name = optarg;
+          break;
+        case 'e':
+          extrabps = atof(optarg);
+          cmd |= CTL_EXTRA;
+          break;
+        case 'l':
+          verbose = atoi(optarg);
+          cmd |= CTL_VERBOSE;
+          break;
+        case 't':
+          stats = (strcmp(optarg, "on") == 0 || strcmp(optarg, "1") == 0);
+          cmd |= CTL_STATS;
+          break;
+        case 's':
+          cmd |= CTL_SNAPSHOT;
+          break;
+        case 'L':
+          latency = 1;
+          break;
+        case 'x':
+          cmd |= CTL_STOP;
+          break;
+        case 'V':
+          fprintf(stderr, "hrtctl (version %s of frankl's stereo utilities)\n",
+                  VERSION);
+          exit(0);
+        default:
+          usage();
+          exit(1);
+        }
+    }
+    if (name == NULL) {
+        fprintf(stderr, "hrtctl: Need --shmname argument . . . bye.\n");
+        exit(1);
+    }
+    if ((ctl = ctlpage_attach("hrtctl", name)) == NULL)
+        exit(2);
+    if (cmd & CTL_EXTRA)
+        ctl->extrabps = extrabps;
+    if (cmd & CTL_VERBOSE)
+        ctl->verbose = verbose;
+    if (cmd & CTL_STATS)
+        ctl->stats = stats;
+    if (latency) {
+        if (ctlpage_getlatency(ctl, &ltime, &lat, &hwdelay, &buffered, &rate))
+            printf("latency %.3f msec\nframes in device %lld\n"
+                   "frames buffered %lld\nsample rate %d\n"
+                   "measured at %lld.%09lld\n", lat/1000000.0, hwdelay,
+                   buffered, rate, ltime/1000000000, ltime%1000000000);
+        else
+            fprintf(stderr, "hrtctl: No latency published by process %d.\n",
+                    ctl->pid);
+    }
+    if (cmd == 0)
+        return 0;
+    /* values must be visible before the command bits and the new seq */
+    __sync_synchronize();
+    __sync_fetch_and_or(&ctl->cmd, cmd);
+    seq = __sync_add_and_fetch(&ctl->seq, 1);
+    if (cmd & CTL_SNAPSHOT) {
+        /* wait up to a second for the running program */
+        for (i = 0; i < 1000 && (int)(ctl->snapseq - seq) < 0; i++)
+            usleep(1000);
+        if ((int)(ctl->snapseq - seq) < 0) {
+            fprintf(stderr, "hrtctl: No answer from process %d.\n", ctl->pid);
+            exit(3);
+        }
+        printf("pid %d\nloops %lld\nbytes in %lld\nbytes out %lld\n"
+               "delayed loops %lld\nbad reads %lld\nbad writes %lld\n"
+               "buffer fill %lld\nloop duration %lld nsec\n"
+               "extra bytes per second %.3f\n",
+               ctl->pid, ctl->loops, ctl->inbytes, ctl->outbytes,
+               ctl->delayed, ctl->badreads, ctl->badwrites, ctl->fill,
+               ctl->nsec, ctl->curextrabps);
+        if (ctl->connects > 0)
+            printf("connections %lld\nlost connections %lld\n",
+                   ctl->connects, ctl->disconnects);
+    }
+    return 0;
+}
+
@@ -0,0 +1,145 @@
+/*
+looprec.c                Copyright frankl 2017
+
+This file is part of frankl's stereo utilities.
+See the file License.txt of the distribution and
+http://www.gnu.org/licenses/gpl.txt for license details.
+
+Recording of per-loop timing and buffer data into a preallocated ring
+in memory. The ring is written to a file on exit or on a signal.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include "looprec.h"
+
+#define OBUFLEN 65536
+
+volatile sig_atomic_t looprec_sig = 0;
+
+static struct looprecord *recs = NULL, *cur;
+static long nrrecs, total;
+static char *recfile, *recprog, obuf[OBUFLEN];
+
+/* only note the signal, the loop calls looprec_check */
+static void handler(int sig) {
+  looprec_sig = sig;
+}
+
+/* allocate and touch the ring (so that no page faults occur in the
+   loop), dump on exit and on signals; a second SIGINT or SIGTERM ends
+   the program directly (e.g., while it is blocked in a read) */
+void looprec_init(char *prog, char *fname, long nrecs) {
+  struct sigaction sa;
+
+  recprog = prog;
+  recfile = fname;
+  nrrecs = nrecs;
+  total = 0;
+  if (nrrecs < 1)
+     nrrecs = 1;
+  if (! (recs = malloc(nrrecs*sizeof(struct looprecord))) ) {
+     fprintf(stderr, "%s: Cannot allocate %ld loop records.\n", prog, nrrecs);
+     exit(40);
+  }
+  memset(recs, 0, nrrecs*sizeof(struct looprecord));
+  mlock(recs, nrrecs*sizeof(struct looprecord));
+  cur = recs;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = handler;
+  sa.sa_flags = SA_RESTART;
+  sigemptyset(&sa.sa_mask);
+  sigaction(SIGUSR1, &sa, NULL);
+  sa.sa_flags = SA_RESTART | SA_RESETHAND;
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+  atexit(looprec_dump);
+}
+
+/* call directly after waking up, mtime is the intended wakeup time */
+void looprec_wakeup(struct timespec *mtime) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  cur->wake = mtime->tv_sec*1000000000LL + mtime->tv_nsec;
+  cur->late = (now.tv_sec-mtime->tv_sec)*1000000000LL +
+              (now.tv_nsec-mtime->tv_nsec);
+}
+
+/* call once at end of loop, completes the record */
+void looprec_add(long avail, long in, long out) {
+  cur->avail = avail;
+  cur->in = in;
+  cur->out = out;
+  total++;
+  cur++;
+  if (cur == recs + nrrecs)
+     cur = recs;
+}
+
+/* call in the loop if looprec_sig is set: on SIGUSR1 the records are
+   written and we continue, on SIGINT and SIGTERM this returns 1 and the
+   loop should stop as on a stop command (the records are written at
+   exit) */
+int looprec_check(void) {
+  int sig = looprec_sig;
+
+  looprec_sig = 0;
+  if (sig != SIGUSR1)
+     return 1;
+  looprec_dump();
+  return 0;
+}
+
+/* write records as CSV (if file name ends in '.csv') or binary */
+void looprec_dump(void) {
+  long i, n, first;
+  int fd, csv, len, hd[4];
+  char line[128];
+  struct looprecord *r;
+
+  if (recs == NULL)
+     return;
+  n = (total < nrrecs) ? total : nrrecs;
+  first = (total < nrrecs) ? 0 : total % nrrecs;
+  csv = (strlen(recfile) > 4 &&
+         strcmp(recfile+strlen(recfile)-4, ".csv") == 0);
+  if ((fd = open(recfile, O_WRONLY | O_CREAT | O_TRUNC, 00644)) == -1) {
+     len = snprintf(line, 128, "%s: Cannot open record file.\n", recprog);
+     len = write(2, line, len);
+     return;
+  }
+  if (csv) {
+     len = snprintf(line, 128, "loop,wake_ns,late_ns,avail,in,out\n");
+     if (write(fd, line, len) < len)
+        n = 0;
+  } else {
+     memcpy(hd, "LREC", 4);
+     hd[1] = 1;
+     hd[2] = sizeof(struct looprecord);
+     hd[3] = n;
+     if (write(fd, hd, 4*sizeof(int)) < 4*sizeof(int))
+        n = 0;
+  }
+  /* collect lines in a static buffer to avoid a write per record */
+  for (i = 0, len = 0; i < n; i++) {
+     r = recs + (first+i) % nrrecs;
+     if (csv)
+        len += snprintf(obuf+len, 128, "%ld,%lld,%d,%d,%d,%d\n", total-n+i,
+                        r->wake, r->late, r->avail, r->in, r->out);
+     else {
+        memcpy(obuf+len, r, sizeof(struct looprecord));
+        len += sizeof(struct looprecord);
+     }
+     if (len > OBUFLEN-128 || i == n-1) {
+        if (write(fd, obuf, len) < len)
+           break;
+        len = 0;
+     }
+  }
+  close(fd);
+}
+
@@ -0,0 +1,35 @@
+/*
+looprec.h                Copyright frankl 2017
+
+This file is part of frankl's stereo utilities.
+See the file License.txt of the distribution and
+http://www.gnu.org/licenses/gpl.txt for license details.
+
+Recording of per-loop timing and buffer data into a preallocated ring
+in memory. The ring is written to a file on exit or on a signal.
+*/
+
+#include <signal.h>
+#include <time.h>
+
+/* one record per loop, the binary file contains a header
+   "LREC", version, record size, number of records (all 32 bit ints)
+   followed by the records in chronological order */
+struct looprecord {
+    long long wake;  /* intended wakeup time in nsec (CLOCK_MONOTONIC) */
+    int late;        /* actual minus intended wakeup time in nsec */
+    int avail;       /* buffer fill/space, meaning depends on program */
+    int in;          /* bytes read in this loop */
+    int out;         /* bytes written in this loop */
+};
+
+/* set on SIGUSR1, SIGINT and SIGTERM, then call looprec_check() in the
+   loop, it returns 1 if the loop should stop */
+extern volatile sig_atomic_t looprec_sig;
+
+void looprec_init(char *prog, char *fname, long nrecs);
+void looprec_wakeup(struct timespec *mtime);
+void looprec_add(long avail, long in, long out);
+int looprec_check(void);
+void looprec_dump(void);
+
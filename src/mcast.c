@@ -0,0 +1,344 @@
+/*
+mcast.c                Copyright frankl 2017
+
+This file is part of frankl's stereo utilities.
+See the file License.txt of the distribution and
+http://www.gnu.org/licenses/gpl.txt for license details.
+
+UDP multicast of a stream, see mcast.h.
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "mcast.h"
+#include "hist.h"
+#include "tstamp.h"
+
+#define PKTSIZE (sizeof(struct mcasthdr) + MCAST_PAYLOAD)
+
+/* "address:port[:interface]" */
+static void mcast_parse(char *prog, char *group, struct sockaddr_in *addr,
+                        struct in_addr *ifaddr) {
+  char buf[100], *p, *q;
+
+  strncpy(buf, group, 99);
+  buf[99] = '\0';
+  memset(addr, 0, sizeof(struct sockaddr_in));
+  addr->sin_family = AF_INET;
+  ifaddr->s_addr = htonl(INADDR_ANY);
+  if ((p = strchr(buf, ':')) == NULL) {
+     fprintf(stderr, "%s: Multicast group must be given as address:port.\n",
+             prog);
+     exit(70);
+  }
+  *p++ = '\0';
+  if ((q = strchr(p, ':')) != NULL) {
+     *q++ = '\0';
+     if (inet_aton(q, ifaddr) == 0) {
+        fprintf(stderr, "%s: Invalid interface address %s.\n", prog, q);
+        exit(70);
+     }
+  }
+  addr->sin_port = htons(atoi(p));
+  if (inet_aton(buf, &addr->sin_addr) == 0 ||
+      !IN_MULTICAST(ntohl(addr->sin_addr.s_addr))) {
+     fprintf(stderr, "%s: %s is not a multicast address.\n", prog, buf);
+     exit(70);
+  }
+}
+
+static struct mcast *mcast_new(char *prog, int verbose) {
+  struct mcast *mc;
+
+  if (! (mc = calloc(1, sizeof(struct mcast)))) {
+     fprintf(stderr, "%s: Cannot allocate multicast buffer.\n", prog);
+     exit(71);
+  }
+  mc->prog = prog;
+  mc->verbose = verbose;
+  if ((mc->fd = socket(AF_INET, SOCK_DGRAM, 0)) == -1) {
+     fprintf(stderr, "%s: Cannot create multicast socket.\n", prog);
+     exit(71);
+  }
+  return mc;
+}
+
+/* the socket is connected to the group, packets stay in the local
+   network (TTL 1) and are also delivered to receivers on this machine */
+struct mcast *mcast_sender(char *prog, char *group, int sndbuf, int verbose) {
+  struct mcast *mc;
+  struct sockaddr_in addr;
+  struct in_addr ifaddr;
+  int ttl = 1, loop = 1;
+
+  mcast_parse(prog, group, &addr, &ifaddr);
+  mc = mcast_new(prog, verbose);
+  if (! (mc->pkts = calloc(MCAST_BATCH+1, PKTSIZE))) {
+     fprintf(stderr, "%s: Cannot allocate multicast buffer.\n", prog);
+     exit(71);
+  }
+  setsockopt(mc->fd, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(int));
+  setsockopt(mc->fd, IPPROTO_IP, IP_MULTICAST_LOOP, &loop, sizeof(int));
+  if (ifaddr.s_addr != htonl(INADDR_ANY) &&
+      setsockopt(mc->fd, IPPROTO_IP, IP_MULTICAST_IF, &ifaddr,
+                 sizeof(ifaddr)) == -1) {
+     fprintf(stderr, "%s: Cannot use interface %s for multicast: %s.\n",
+             prog, inet_ntoa(ifaddr), strerror(errno));
+     exit(72);
+  }
+  if (sndbuf != 0 && setsockopt(mc->fd, SOL_SOCKET, SO_SNDBUF, &sndbuf,
+                                sizeof(int)) == -1) {
+     fprintf(stderr, "%s: Cannot set multicast buffer to %d.\n", prog, sndbuf);
+     exit(72);
+  }
+  if (connect(mc->fd, (struct sockaddr*)&addr, sizeof(addr)) == -1) {
+     fprintf(stderr, "%s: Cannot send to multicast group %s: %s.\n", prog,
+             group, strerror(errno));
+     exit(72);
+  }
+  return mc;
+}
+
+/* send the complete packets with as few calls as possible, in the loop
+   we do not wait: packets which the socket does not take are dropped
+   (receivers see a gap); at the end we wait, so that the tail of the
+   stream and the end marks are not lost */
+static void mcast_send(struct mcast *mc, int wait) {
+  struct mmsghdr msgs[MCAST_BATCH];
+  struct iovec iov[MCAST_BATCH];
+  struct mcasthdr *hdr;
+  int i, off, r;
+
+  memset(msgs, 0, mc->npkts*sizeof(struct mmsghdr));
+  for (i = 0; i < mc->npkts; i++) {
+     hdr = (struct mcasthdr*)(mc->pkts + i*PKTSIZE);
+     iov[i].iov_base = hdr;
+     iov[i].iov_len = sizeof(struct mcasthdr) + hdr->len;
+     msgs[i].msg_hdr.msg_iov = iov+i;
+     msgs[i].msg_hdr.msg_iovlen = 1;
+  }
+  for (off = 0; off < mc->npkts; off += r) {
+     r = sendmmsg(mc->fd, msgs+off, mc->npkts-off, wait ? 0 : MSG_DONTWAIT);
+     mc->calls++;
+     if (r < 0) {
+        if (errno == EINTR) {
+           r = 0;
+           continue;
+        }
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != ENOBUFS) {
+           fprintf(stderr, "%s: Multicast send error: %s.\n", mc->prog,
+                   strerror(errno));
+           exit(73);
+        }
+        mc->dropped += mc->npkts - off;
+        break;
+     }
+     mc->sent += r;
+  }
+  /* the partly filled packet moves to the front */
+  if (mc->fill > 0)
+     memmove(mc->pkts, mc->pkts + mc->npkts*PKTSIZE, PKTSIZE);
+  mc->npkts = 0;
+}
+
+static void mcast_seal(struct mcast *mc, long len) {
+  struct mcasthdr *hdr;
+
+  hdr = (struct mcasthdr*)(mc->pkts + mc->npkts*PKTSIZE);
+  hdr->magic = MCAST_MAGIC;
+  hdr->len = len;
+  hdr->seq = mc->seq++;
+  mc->npkts++;
+}
+
+/* append len bytes to the stream and send all complete packets, a rest
+   smaller than a packet is sent with the next call */
+long mcast_write(struct mcast *mc, char *ptr, long len) {
+  long done, n;
+  char *p;
+
+  for (done = 0; done < len; done += n) {
+     p = mc->pkts + mc->npkts*PKTSIZE + sizeof(struct mcasthdr);
+     n = MCAST_PAYLOAD - mc->fill;
+     if (n > len - done)
+        n = len - done;
+     memcpy(p + mc->fill, ptr + done, n);
+     mc->fill += n;
+     if (mc->fill == MCAST_PAYLOAD) {
+        mc->fill = 0;
+        mcast_seal(mc, MCAST_PAYLOAD);
+        if (mc->npkts == MCAST_BATCH)
+           mcast_send(mc, 0);
+     }
+  }
+  if (mc->npkts > 0)
+     mcast_send(mc, 0);
+  return len;
+}
+
+/* several receivers on the same machine can join the same group */
+struct mcast *mcast_receiver(char *prog, char *group, int rcvbuf,
+                             int verbose) {
+  struct mcast *mc;
+  struct sockaddr_in addr;
+  struct ip_mreq mreq;
+  int optval = 1;
+
+  mcast_parse(prog, group, &addr, &mreq.imr_interface);
+  mc = mcast_new(prog, verbose);
+  if (! (mc->pkt = malloc(2*PKTSIZE))) {
+     fprintf(stderr, "%s: Cannot allocate multicast buffer.\n", prog);
+     exit(71);
+  }
+  setsockopt(mc->fd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(int));
+  if (rcvbuf != 0 && setsockopt(mc->fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf,
+                                sizeof(int)) == -1) {
+     fprintf(stderr, "%s: Cannot set multicast buffer to %d.\n", prog, rcvbuf);
+     exit(72);
+  }
+  if (bind(mc->fd, (struct sockaddr*)&addr, sizeof(addr)) == -1) {
+     fprintf(stderr, "%s: Cannot bind to multicast group %s: %s.\n", prog,
+             group, strerror(errno));
+     exit(72);
+  }
+  mreq.imr_multiaddr = addr.sin_addr;
+  if (setsockopt(mc->fd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq,
+                 sizeof(mreq)) == -1) {
+     fprintf(stderr, "%s: Cannot join multicast group %s: %s.\n", prog,
+             group, strerror(errno));
+     exit(72);
+  }
+  return mc;
+}
+
+/* receive the next packet, returns 1 if a packet was taken, 0 if there
+   are no more packets, -1 on error; the first packet can have any
+   sequence number (late join), after it we stop if no packet arrives for
+   2 seconds */
+static int mcast_recv(struct mcast *mc, int wait) {
+  struct mcasthdr *hdr;
+  struct timeval tv;
+  ssize_t s;
+
+  hdr = (struct mcasthdr*)mc->pkt;
+  while (1) {
+     if (mc->ts != NULL)
+        s = tstamp_recv(mc->ts, mc->fd, mc->pkt, 2*PKTSIZE,
+                        wait ? 0 : MSG_DONTWAIT);
+     else
+        s = recv(mc->fd, mc->pkt, 2*PKTSIZE, wait ? 0 : MSG_DONTWAIT);
+     if (s < 0) {
+        if (errno == EINTR)
+           continue;
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+           if (wait) {
+              if (mc->verbose)
+                 fprintf(stderr, "%s: No multicast data for 2 seconds.\n",
+                         mc->prog);
+              mc->done = 1;
+           }
+           return 0;
+        }
+        return -1;
+     }
+     if (s < sizeof(struct mcasthdr) || hdr->magic != MCAST_MAGIC ||
+         hdr->len != s - sizeof(struct mcasthdr)) {
+        mc->invalid++;
+        continue;
+     }
+     if (!mc->started) {
+        mc->started = 1;
+        mc->seq = hdr->seq;
+        tv.tv_sec = 2;
+        tv.tv_usec = 0;
+        setsockopt(mc->fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+     }
+     if (hdr->seq < mc->seq) {
+        mc->late++;
+        continue;
+     }
+     if (hdr->seq > mc->seq) {
+        mc->gaps++;
+        mc->lost += hdr->seq - mc->seq;
+        mc->zeros = (hdr->seq - mc->seq)*MCAST_PAYLOAD;
+     }
+     mc->seq = hdr->seq + 1;
+     mc->received++;
+     if (hdr->len == 0)
+        mc->done = 1;
+     mc->plen = hdr->len;
+     mc->ppos = 0;
+     return 1;
+  }
+}
+
+/* read up to len bytes of the stream, we only wait for packets as long
+   as nothing was read */
+ssize_t mcast_read(struct mcast *mc, char *ptr, size_t len) {
+  size_t got, n;
+  int r;
+
+  for (got = 0; got < len && !mc->done; got += n) {
+     if (mc->zeros > 0) {
+        n = (len - got < mc->zeros) ? len - got : mc->zeros;
+        memset(ptr + got, 0, n);
+        mc->zeros -= n;
+        continue;
+     }
+     if (mc->ppos < mc->plen) {
+        n = (len - got < mc->plen - mc->ppos) ? len - got : mc->plen - mc->ppos;
+        memcpy(ptr + got, mc->pkt + sizeof(struct mcasthdr) + mc->ppos, n);
+        mc->ppos += n;
+        continue;
+     }
+     n = 0;
+     r = mcast_recv(mc, got == 0);
+     if (r == 0)
+        break;
+     if (r < 0)
+        return got > 0 ? got : -1;
+  }
+  return got;
+}
+
+/* position in the stream (in bytes) of the next byte read, we wait for
+   the first packet if necessary */
+long long mcast_position(struct mcast *mc) {
+  if (!mc->started && mcast_recv(mc, 1) <= 0)
+     return -1;
+  /* inserted zeros come before the current packet */
+  return (mc->seq - 1)*MCAST_PAYLOAD + mc->ppos - mc->zeros;
+}
+
+/* a sender sends the rest of the stream and marks the end (a few
+   times, packets can be lost) */
+void mcast_close(struct mcast *mc) {
+  int i;
+
+  if (mc->pkts != NULL) {
+     if (mc->fill > 0) {
+        mcast_seal(mc, mc->fill);
+        mc->fill = 0;
+     }
+     for (i = 0; i < 3; i++)
+        mcast_seal(mc, 0);
+     mcast_send(mc, 1);
+     if (mc->verbose)
+        fprintf(stderr, "%s: Multicast: %lld packets sent in %lld calls, "
+                        "%lld dropped.\n", mc->prog, mc->sent, mc->calls,
+                        mc->dropped);
+  } else if (mc->verbose)
+     fprintf(stderr, "%s: Multicast: %lld packets received, %lld gaps (%lld "
+                     "packets lost), %lld late, %lld invalid.\n", mc->prog,
+                     mc->received, mc->gaps, mc->lost, mc->late, mc->invalid);
+  close(mc->fd);
+}
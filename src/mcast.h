@@ -0,0 +1,58 @@
+/*
+mcast.h                Copyright frankl 2017
+
+This file is part of frankl's stereo utilities.
+See the file License.txt of the distribution and
+http://www.gnu.org/licenses/gpl.txt for license details.
+
+UDP multicast of a stream (option --multicast of 'bufhrt' and 'playhrt'):
+the sender cuts the stream into packets of MCAST_PAYLOAD bytes with a
+sequence number and sends the packets of each loop with one sendmmsg
+call, any number of receivers can join the group. Receivers put in
+zeros for lost packets, so the stream keeps its length and timing.
+
+The group is given as "address:port" or "address:port:interface", where
+interface is the local address of the network interface to use (e.g.,
+127.0.0.1 for receivers on the same machine).
+*/
+
+#include <sys/types.h>
+#include <netinet/in.h>
+
+#define MCAST_MAGIC 0x3153434d    /* "MCS1" */
+/* fits into an ethernet frame and is a multiple of all frame sizes */
+#define MCAST_PAYLOAD 1440
+#define MCAST_BATCH 64
+
+struct mcasthdr {
+    unsigned int magic;
+    unsigned int len;             /* bytes of payload, 0 marks the end */
+    unsigned long long seq;
+};
+
+struct mcast {
+    char *prog;
+    int fd;
+    int verbose;
+    unsigned long long seq;       /* next sequence number */
+    /* sender: MCAST_BATCH packets, the last one may be partly filled */
+    char *pkts;
+    int npkts;                    /* number of complete packets */
+    long fill;                    /* bytes in the partly filled packet */
+    long long sent, dropped, calls;
+    /* receiver */
+    char *pkt;
+    long plen, ppos;
+    long long zeros;              /* zero bytes to insert for lost packets */
+    int started, done;
+    long long received, gaps, lost, late, invalid;
+    struct tstamp *ts;            /* receiver: kernel timestamps, if set */
+};
+
+struct mcast *mcast_sender(char *prog, char *group, int sndbuf, int verbose);
+long mcast_write(struct mcast *mc, char *ptr, long len);
+struct mcast *mcast_receiver(char *prog, char *group, int rcvbuf,
+                             int verbose);
+ssize_t mcast_read(struct mcast *mc, char *ptr, size_t len);
+long long mcast_position(struct mcast *mc);
+void mcast_close(struct mcast *mc);
@@ -8,6 +8,11 @@ http://www.gnu.org/licenses/gpl.txt for license details.
 
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <stddef.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
 #include <netdb.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -15,13 +20,50 @@ http://www.gnu.org/licenses/gpl.txt for license details.
 #include <string.h>
 
 
+int fd_isunix(char *name) {
+    return name != NULL && strncmp(name, "unix:", 5) == 0;
+}
+
+/* fills addr for a name "unix:/path" or "unix:@name" and returns its
+   length, abstract names have a leading zero byte and no trailing one */
+static socklen_t unixaddr(char *name, struct sockaddr_un *addr) {
+    size_t n;
+
+    name += 5;
+    n = strlen(name);
+    if (n < 2 || n >= sizeof(addr->sun_path)) {
+        fprintf(stderr, "net: Invalid name of unix socket: %s.\n", name);
+        exit(107);
+    }
+    memset(addr, 0, sizeof(struct sockaddr_un));
+    addr->sun_family = AF_UNIX;
+    memcpy(addr->sun_path, name, n);
+    if (name[0] == '@') {
+        addr->sun_path[0] = '\0';
+        return offsetof(struct sockaddr_un, sun_path) + n;
+    }
+    return offsetof(struct sockaddr_un, sun_path) + n + 1;
+}
+
 /* returns file descriptor for network connection 
    (taken from man page of getaddrinfo)            */
 int fd_net(char *host, char *port) {
     struct addrinfo hints;
     struct addrinfo *result, *rp;
+    struct sockaddr_un uaddr;
+    socklen_t ulen;
     int s, sfd;
 
+    if (fd_isunix(host)) {
+        ulen = unixaddr(host, &uaddr);
+        if ((sfd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1 ||
+            connect(sfd, (struct sockaddr*)&uaddr, ulen) == -1) {
+            fprintf(stderr, "net: Could not connect to %s.\n", host);
+            exit(102);
+        }
+        return sfd;
+    }
+
     /* Obtain address(es) matching host/port */
     memset(&hints, 0, sizeof(struct addrinfo));
     hints.ai_family = AF_UNSPEC;    /* Allow IPv4 or IPv6 */
@@ -58,3 +100,67 @@ int fd_net(char *host, char *port) {
     return sfd;
 }
 
+
+/* returns file descriptor of a socket listening on port (any address),
+   with sndbuf != 0 the send buffer size of accepted sockets is set
+   (this is not inherited by accepted unix sockets, the caller must set
+   it again); a stale unix socket in the file system is removed; errors
+   are reported for prog, with exit codes 9, 10, 30 and 11 */
+int fd_listen(char *prog, char *port, int sndbuf, int backlog) {
+    struct sockaddr_in serv_addr;
+    struct sockaddr_un uaddr;
+    struct stat sb;
+    socklen_t ulen;
+    int listenfd, optval = 1;
+
+    if (fd_isunix(port)) {
+        ulen = unixaddr(port, &uaddr);
+        if (uaddr.sun_path[0] != '\0' && stat(uaddr.sun_path, &sb) == 0 &&
+            S_ISSOCK(sb.st_mode))
+            unlink(uaddr.sun_path);
+        listenfd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (listenfd < 0) {
+            fprintf(stderr, "%s: Cannot create outgoing socket.\n", prog);
+            exit(9);
+        }
+        if (sndbuf != 0 && setsockopt(listenfd,
+                       SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(int)) == -1) {
+            fprintf(stderr, "%s: Cannot set outgoing network buffer to %d.\n",
+                    prog, sndbuf);
+            exit(30);
+        }
+        if (bind(listenfd, (struct sockaddr*)&uaddr, ulen) == -1) {
+            fprintf(stderr, "%s: Cannot bind outgoing socket.\n", prog);
+            exit(11);
+        }
+        listen(listenfd, backlog);
+        return listenfd;
+    }
+    listenfd = socket(AF_INET, SOCK_STREAM, 0);
+    if (listenfd < 0) {
+        fprintf(stderr, "%s: Cannot create outgoing socket.\n", prog);
+        exit(9);
+    }
+    if (setsockopt(listenfd,
+                   SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(int)) == -1) {
+        fprintf(stderr, "%s: Cannot set REUSEADDR.\n", prog);
+        exit(10);
+    }
+    if (sndbuf != 0 && setsockopt(listenfd,
+                   SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(int)) == -1) {
+        fprintf(stderr, "%s: Cannot set outgoing network buffer to %d.\n",
+                prog, sndbuf);
+        exit(30);
+    }
+    memset(&serv_addr, 0, sizeof(serv_addr));
+    serv_addr.sin_family = AF_INET;
+    serv_addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    serv_addr.sin_port = htons(atoi(port));
+    if (bind(listenfd, (struct sockaddr*)&serv_addr,
+                                          sizeof(serv_addr)) == -1) {
+        fprintf(stderr, "%s: Cannot bind outgoing socket.\n", prog);
+        exit(11);
+    }
+    listen(listenfd, backlog);
+    return listenfd;
+}
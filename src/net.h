@@ -7,5 +7,9 @@ http://www.gnu.org/licenses/gpl.txt for license details.
 */
 
 
+/* host (for fd_net) or port (for fd_listen) can also be a local unix
+   domain socket: "unix:/path" in the file system or "unix:@name" in the
+   abstract namespace (then the port for fd_net is ignored) */
+int fd_isunix(char *name);
 int fd_net(char *host, char *port);
-
+int fd_listen(char *prog, char *port, int sndbuf, int backlog);
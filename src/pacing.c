@@ -0,0 +1,274 @@
+/*
+pacing.c                Copyright frankl 2017
+
+This file is part of frankl's stereo utilities.
+See the file License.txt of the distribution and
+http://www.gnu.org/licenses/gpl.txt for license details.
+
+The timed loop of 'bufhrt' and 'playhrt', see pacing.h.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "hist.h"
+#include "looprec.h"
+#include "pacing.h"
+
+/* (a*b)/d and (a*b)%d for b = 10^k, without overflow for d < 2^63/10 */
+static void muldiv10(long long a, int k, long long d, long long *q,
+                     long long *r)
+{
+    long long qq, rr;
+
+    qq = a / d;
+    rr = a % d;
+    for (; k > 0; k--) {
+        qq = 10*qq + (10*rr)/d;
+        rr = (10*rr) % d;
+    }
+    *q = qq;
+    *r = rr;
+}
+
+/* time step 10^9*U/((U+extra)*L) nsec as q + r/den, extra is used with
+   a resolution of 1/1000 unit per second if den stays below 9*10^17 */
+static void pace_setstep(struct pacing *p)
+{
+    long long s, b, e;
+
+    s = 1000;
+    if ((p->unitspersec + fabs(p->extra))*p->loopspersec >= 9e14)
+        s = 1;
+    b = p->unitspersec*s;
+    e = llround(p->extra*s);
+    if (b + e <= 0) {
+        fprintf(stderr, "%s: Extra bytes per second too small.\n", p->prog);
+        exit(80);
+    }
+    p->den = (b + e)*p->loopspersec;
+    muldiv10(b, 9, p->den, &p->q, &p->r);
+    p->racc = 0;
+    p->nsec = p->q + (2*p->r >= p->den ? 1 : 0);
+}
+
+void pace_init(struct pacing *p, char *prog, long long unitspersec,
+               long loopspersec, double extra, int stats)
+{
+    memset(p, 0, sizeof(struct pacing));
+    p->prog = prog;
+    p->unitspersec = unitspersec;
+    p->loopspersec = loopspersec;
+    p->extra = extra;
+    p->size = unitspersec/loopspersec;
+    p->rem = unitspersec % loopspersec;
+    if (p->size <= 0) {
+        p->size = 1;
+        p->rem = 0;
+    }
+    p->stats = stats;
+    hist_init(&p->wake);
+    pace_setstep(p);
+}
+
+/* new extra units per second, used from the next step */
+void pace_extra(struct pacing *p, double extra)
+{
+    p->extra = extra;
+    pace_setstep(p);
+}
+
+/* repay a debt with at most percent of unitspersec extra, within msec */
+void pace_catchup(struct pacing *p, long msec, double percent)
+{
+    p->crate = llround(p->unitspersec*percent/100.0);
+    if (p->crate < 1)
+        p->crate = 1;
+    p->cq = p->crate/p->loopspersec;
+    p->cr = p->crate % p->loopspersec;
+    p->burst = p->cq + (p->cr > 0 ? 1 : 0);
+    p->debtmax = p->crate*msec/1000;
+}
+
+/* units which should have been written but were not; first this undoes
+   the repayment of the current loop, the rest is new debt */
+void pace_missed(struct pacing *p, long long units)
+{
+    long long r;
+
+    if (p->burst == 0 || units <= 0)
+        return;
+    r = units < p->lastrepay ? units : p->lastrepay;
+    p->lastrepay -= r;
+    p->repaid -= r;
+    p->debt += r;
+    units -= r;
+    p->accrued += units;
+    p->debt += units;
+    if (p->debt > p->debtmax) {
+        p->dropped += p->debt - p->debtmax;
+        p->debt = p->debtmax;
+    }
+    if (p->debt > p->maxdebt)
+        p->maxdebt = p->debt;
+}
+
+/* the timeline starts now (again) */
+void pace_start(struct pacing *p)
+{
+    clock_gettime(CLOCK_MONOTONIC, &p->next);
+    if (p->clock != NULL)
+        p->clock(p->clockarg, &p->next, 0);
+    p->racc = 0;
+    p->restarts++;
+}
+
+void pace_step(struct pacing *p)
+{
+    p->next.tv_nsec += p->q;
+    p->racc += p->r;
+    if (p->racc >= p->den) {
+        p->racc -= p->den;
+        p->next.tv_nsec++;
+    }
+    while (p->next.tv_nsec > 999999999) {
+        p->next.tv_nsec -= 1000000000;
+        p->next.tv_sec++;
+    }
+}
+
+/* with statistics we check if the wakeup time has already passed, and
+   with stats > 1 how late we really wake up (this costs a clock_gettime
+   call between the wakeup and the write) */
+void pace_sleep(struct pacing *p)
+{
+    struct timespec t, w;
+    long long late;
+
+    p->lastrepay = 0;
+    w = p->next;
+    if (p->clock != NULL)
+        p->clock(p->clockarg, &w, 1);
+    if (p->stats || p->burst > 0) {
+        clock_gettime(CLOCK_MONOTONIC, &t);
+        late = (t.tv_sec-w.tv_sec)*1000000000LL + t.tv_nsec-w.tv_nsec;
+        if (late > 0)
+            p->delayed++;
+        /* with catch-up the missed loops become debt */
+        if (p->burst > 0 && late > p->q) {
+            pace_missed(p, late/1000000000LL*p->unitspersec +
+                           late%1000000000LL*p->unitspersec/1000000000LL);
+            w = t;
+            p->next = t;
+            if (p->clock != NULL)
+                p->clock(p->clockarg, &p->next, 0);
+            p->racc = 0;
+            p->stalls++;
+        }
+    }
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &w, NULL) != 0) ;
+    if (p->record != NULL && *p->record)
+        looprec_wakeup(&w);
+    if (p->stats > 1) {
+        clock_gettime(CLOCK_MONOTONIC, &t);
+        hist_add(&p->wake, (t.tv_sec-w.tv_sec)*1000000000LL +
+                           t.tv_nsec-w.tv_nsec);
+    }
+    p->loops++;
+}
+
+/* sleep and then write, this comes first after waking up */
+ssize_t pace_write(struct pacing *p, pace_sink sink, void *arg, void *ptr,
+                   size_t len)
+{
+    ssize_t s;
+
+    pace_sleep(p);
+    s = sink(arg, ptr, len);
+    if (s >= 0) {
+        p->units += s;
+        if (s < len)
+            p->shortwrites++;
+    }
+    return s;
+}
+
+/* units for the next loop */
+long pace_size(struct pacing *p)
+{
+    long n, x;
+
+    p->acc += p->rem;
+    if (p->acc >= p->loopspersec) {
+        p->acc -= p->loopspersec;
+        p->owed++;
+    }
+    n = p->size;
+    if (p->owed > 0) {
+        p->owed--;
+        n++;
+    }
+    if (p->debt > 0) {
+        /* token bucket, at most burst units per loop */
+        p->tokens += p->cq;
+        p->cacc += p->cr;
+        if (p->cacc >= p->loopspersec) {
+            p->cacc -= p->loopspersec;
+            p->tokens++;
+        }
+        if (p->tokens > p->burst)
+            p->tokens = p->burst;
+        x = p->tokens < p->debt ? p->tokens : p->debt;
+        p->tokens -= x;
+        p->debt -= x;
+        p->repaid += x;
+        p->lastrepay += x;
+        n += x;
+    } else
+        p->tokens = 0;
+    return n;
+}
+
+/* units not written now which are added later, one per loop */
+void pace_owe(struct pacing *p, long long units)
+{
+    p->owed += units;
+}
+
+/* len must be smaller than max, returns the number of units dropped
+   (with catch-up they are added to the debt) */
+long pace_clamp(struct pacing *p, long *len, long max)
+{
+    long d;
+
+    if (*len < max)
+        return 0;
+    d = *len - max + 1;
+    *len = max - 1;
+    p->underruns++;
+    p->underunits += d;
+    pace_missed(p, d);
+    return d;
+}
+
+void pace_report(struct pacing *p)
+{
+    fprintf(stderr, "%s: Pacing: %lld loops, step %lld+%lld/%lld nsec, %lld "
+                    "units written, %lld short writes, %lld underruns (%lld "
+                    "units), %lld timeline starts.\n", p->prog, p->loops, p->q,
+                    p->r, p->den, p->units, p->shortwrites, p->underruns,
+                    p->underunits, p->restarts);
+    if (p->stats) {
+        fprintf(stderr, "%s: Pacing: %lld loops started after their "
+                        "wakeup time.\n", p->prog, p->delayed);
+        if (p->stats > 1)
+            hist_print(p->prog, "Wakeup after sleep", &p->wake);
+    }
+    if (p->burst > 0)
+        fprintf(stderr, "%s: Catch-up: %lld units of debt accrued (%lld "
+                        "stalls), %lld repaid, %lld dropped, max debt %lld, "
+                        "%lld left at end.\n", p->prog, p->accrued,
+                        p->stalls, p->repaid, p->dropped, p->maxdebt,
+                        p->debt);
+}
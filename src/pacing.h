@@ -0,0 +1,99 @@
+/*
+pacing.h                Copyright frankl 2017
+
+This file is part of frankl's stereo utilities.
+See the file License.txt of the distribution and
+http://www.gnu.org/licenses/gpl.txt for license details.
+
+The timed loop of 'bufhrt' and 'playhrt': 'unitspersec' units (bytes or
+frames) are written in 'loopspersec' loops per second, the time step is
+adjusted by 'extra' units per second (for clocks which are not exactly
+synchronous).
+
+Only integers are accumulated: each loop writes 'size' units, plus one
+when the remainder 'rem' of unitspersec/loopspersec has summed up to
+loopspersec. The time step is q + r/den nsec with the exact fraction
+r/den. So neither the amount nor the timing drifts, even over days (the
+old code accumulated a double and rounded the step to whole nsec).
+
+A loop looks like this:
+
+    pace_start(&pc);
+    while (...) {
+        pace_step(&pc);                 next wakeup time in pc.next
+        ... refresh data ...
+        s = pace_write(&pc, sink, arg, ptr, len);   sleep, then write
+        len = pace_size(&pc) + len - s; units for the next loop
+        if (pace_clamp(&pc, &len, max) > 0) ... underrun ...
+    }
+    pace_report(&pc);
+
+The sink is any function which writes to the output (socket, file,
+sound device); pace_sleep can be used instead of pace_write if the
+output is written differently. Include hist.h before this file.
+
+Usually the times are of CLOCK_MONOTONIC. If a 'clock' function is set
+the loop runs in another time (e.g., the clock of a master, see
+clocksync.h), each wakeup time is converted to CLOCK_MONOTONIC just
+before sleeping.
+
+Catch-up (pace_catchup): units which could not be written in time are
+a debt instead of being lost. This is the data missing in the buffer
+(the caller reports it with pace_missed), the units dropped by
+pace_clamp, and the loops missed when we wake up more than a step
+late (e.g., after a blocking read); in the latter case the timeline is
+anchored anew instead of running the missed loops back to back. The
+debt is repaid by pace_size with a token bucket: at most 'rate' units
+per second extra, so at most size/rem + rate/loopspersec (rounded up)
+units per loop. A debt which could not be repaid within 'msec' at this
+rate is dropped.
+*/
+
+#include <sys/types.h>
+#include <time.h>
+
+typedef ssize_t (*pace_sink)(void *arg, void *ptr, size_t len);
+/* converts t from CLOCK_MONOTONIC to the time of the loop, or back */
+typedef void (*pace_clock)(void *arg, struct timespec *t, int tolocal);
+
+struct pacing {
+    char *prog;
+    long long unitspersec;
+    long loopspersec;
+    double extra;
+    /* units per loop: size + rem/loopspersec */
+    long size, rem, acc;
+    long long owed;               /* units to add later, one per loop */
+    /* time step q + r/den nsec */
+    long long q, r, den, racc;
+    long nsec;                    /* rounded time step, for messages */
+    struct timespec next;         /* next wakeup */
+    int stats;                    /* 1: count delayed loops (before the
+                                     sleep), 2: also measure the wakeup
+                                     times (after it, before the write) */
+    int *record;                  /* if set and *record, use looprec */
+    pace_clock clock;             /* if set, next is not CLOCK_MONOTONIC */
+    void *clockarg;
+    /* catch-up, burst is 0 if not used */
+    long long crate, debt, debtmax, tokens, lastrepay;
+    long cq, cr, cacc, burst;
+    /* statistics, restarts counts the calls of pace_start */
+    long long loops, units, shortwrites, delayed, underruns, underunits,
+              restarts, stalls, accrued, repaid, dropped, maxdebt;
+    struct hist wake;             /* time after wakeup time */
+};
+
+void pace_init(struct pacing *p, char *prog, long long unitspersec,
+               long loopspersec, double extra, int stats);
+void pace_extra(struct pacing *p, double extra);
+void pace_catchup(struct pacing *p, long msec, double percent);
+void pace_start(struct pacing *p);
+void pace_step(struct pacing *p);
+void pace_sleep(struct pacing *p);
+ssize_t pace_write(struct pacing *p, pace_sink sink, void *arg, void *ptr,
+                   size_t len);
+long pace_size(struct pacing *p);
+void pace_owe(struct pacing *p, long long units);
+long pace_clamp(struct pacing *p, long *len, long max);
+void pace_missed(struct pacing *p, long long units);
+void pace_report(struct pacing *p);
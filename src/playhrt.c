@@ -17,8 +17,23 @@ http://www.gnu.org/licenses/gpl.txt for license details.
 #include <unistd.h>
 #include <string.h>
 #include <time.h>
+#include <math.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/ioctl.h>
 #include <alsa/asoundlib.h>
 #include "cprefresh.h"
+#include "looprec.h"
+#include "ctlpage.h"
+#include "frame.h"
+#include "hist.h"
+#include "pacing.h"
+#include "feedback.h"
+#include "mcast.h"
+#include "clocksync.h"
+#include "tstamp.h"
 
 /* help page */
 /* vim hint to remove resp. add quotes:
@@ -77,7 +92,9 @@ void usage( ) {
 "\n"
 "  --host=hostname, -r hostname\n"
 "      the host from which to receive the data , given by name or\n"
-"      ip-address.\n"
+"      ip-address. If the sender runs on the same machine, a local socket\n"
+"      'unix:/path' or 'unix:@name' can be given instead (as used with\n"
+"      --port-to-write of 'bufhrt'), then --port is not needed.\n"
 "\n"
 "  --port=portnumber, -p portnumber\n"
 "      the port number on the remote host from which to receive data.\n"
@@ -85,6 +102,76 @@ void usage( ) {
 "  --stdin, -S\n"
 "      read data from stdin (instead of --host and --port).\n"
 "\n"
+"  --framed, -E\n"
+"      the input from the network is sent by 'bufhrt' with its option\n"
+"      --framed. Then the latency of the received chunks (the time\n"
+"      between sending and receiving) and the jitter of this latency\n"
+"      are collected in histograms and gaps in the stream are detected.\n"
+"      These statistics are shown with --verbose at the end, they are\n"
+"      useful for tuning the sizes of the network buffers.\n"
+"\n"
+"  --multicast=group:port[:interface], -G group:port[:interface]\n"
+"      receive the data as UDP multicast from 'bufhrt' (with the same\n"
+"      --multicast option) instead of --host and --port. Several\n"
+"      players, also on the same machine, can receive the same stream.\n"
+"      The optional interface is the local address of the network\n"
+"      interface to use (127.0.0.1 if the sender is on the same machine).\n"
+"      Lost packets are replaced by zeros (they are counted and shown\n"
+"      with --verbose). Playback ends 2 seconds after the last packet.\n"
+"      Use --in-net-buffer-size to allow for a larger buffer.\n"
+"\n"
+"  --clock-sync=host:port[:msec]\n"
+"      with --multicast, share the clock of the sending 'bufhrt' (which\n"
+"      must use --clock-master=port). Timestamps are exchanged a few\n"
+"      times per second over UDP (as in PTP); the loop of this program\n"
+"      then runs in the time of the master, and each byte of the stream\n"
+"      is heard msec milliseconds (default 200) after 'bufhrt' has\n"
+"      sent it. The sound device runs with its own clock, so the\n"
+"      playout position is measured a few times per second and single\n"
+"      frames are skipped or repeated to follow the master. So, players\n"
+"      in several rooms play in sync. The input buffers must hold the\n"
+"      data of msec milliseconds (see --in-net-buffer-size), and msec\n"
+"      must be larger than the time of the data in half of the hardware\n"
+"      buffer and, without --mmap, in the input buffer (see\n"
+"      --buffer-size); at the start older data are skipped. With\n"
+"      -v -v the local time when each 10 seconds of the stream are\n"
+"      heard is shown, to compare several players.\n"
+"\n"
+"  --clock-offset=intval[:floatval]\n"
+"      for tests of --clock-sync on a single machine: add intval\n"
+"      nanoseconds and a rate difference of floatval ppm to the clock\n"
+"      of this program.\n"
+"\n"
+"  --rx-timestamps\n"
+"      with --host and --port or with --multicast: the kernel reports\n"
+"      when the packets came in from the network driver (SO_TIMESTAMPING,\n"
+"      software timestamps). With --verbose histograms of the time until\n"
+"      the data are read and of the deviation of the arrival times from\n"
+"      the rate of the stream are shown at the end (see 'bufhrt\n"
+"      --tx-timestamps' for the sending side).\n"
+"\n"
+"  --feedback, -B\n"
+"      with --host and --port, send about ten times per second a small\n"
+"      report on the network connection back to 'bufhrt' (which must\n"
+"      use its option --feedback=net): the number of bytes buffered in\n"
+"      the sound device, in playhrt and in the network buffer, and the\n"
+"      drift of this value.\n"
+"      Then 'bufhrt' adjusts its speed such that the buffer fill stays\n"
+"      constant, and --extra-bytes-per-second need not be calibrated\n"
+"      (use 0 for playhrt). The network buffers can be small.\n"
+"\n"
+"  --file=fname, -I fname\n"
+"      read raw audio data from a file. The file is mapped into memory\n"
+"      and locked there (if the system allows it) before playback\n"
+"      starts. Then no read calls are needed during playback, and with\n"
+"      --mmap the data are copied once from the file into the memory of\n"
+"      the audio driver. So, for local playback no pipe from another\n"
+"      program is needed (e.g., use a file in a ramdisk).\n"
+"\n"
+"  --shmname=/name, -W /name\n"
+"      as --file, but read data from a shared memory file, e.g., written\n"
+"      by 'cptoshm'.\n"
+"\n"
 "  --device=alsaname, -d alsaname\n"
 "      the name of the sound device. A typical name is 'hw:0,0', maybe\n"
 "      use 'aplay -l' to find out the correct numbers. It is recommended\n"
@@ -138,6 +225,13 @@ void usage( ) {
 "      larger value such that it is not necessary to read data during\n"
 "      every loop.\n"
 "\n"
+"  --loops-per-read=intval, -R intval\n"
+"      without --mmap, input is only read in every intval-th loop, with\n"
+"      correspondingly larger chunks (unless --input-size is even\n"
+"      larger). The reads are done in the time between writing and the\n"
+"      next sleep, the output timing is not changed. With many loops per\n"
+"      second this reduces the number of read calls a lot. Default is 1.\n"
+"\n"
 "  --hw-buffer=intval, -c intval\n"
 "      the buffer size (number of frames) used on the sound device.\n"
 "      It may be worth to experiment a bit with this,\n"
@@ -194,6 +288,15 @@ void usage( ) {
 "      This may sometimes be useful to give other programs time to \n"
 "      fill the input buffer of playhrt. Default is no sleep.\n"
 "\n"
+"  --fast-start, -X\n"
+"      in --mmap mode playhrt normally starts the sound device after half\n"
+"      of the hardware buffer was filled in the timed loop, that is after\n"
+"      --hw-buffer/2 frames worth of time. With this option half of the\n"
+"      hardware buffer is filled in one burst as soon as enough input is\n"
+"      available, and playback starts immediately afterwards. The first\n"
+"      sample reaches the device a few milliseconds after input is\n"
+"      available, so no --sleep is needed for the input to fill.\n"
+"\n"
 "  --max-bad-reads=intval, -m intval\n"
 "      playhrt counts how often the read of a block of input data returns\n"
 "      fewer data than requested. If this count exceeds the number given\n"
@@ -201,6 +304,60 @@ void usage( ) {
 "      it is normal that the first block and one or two blocks at the end\n"
 "      return fewer data).\n"
 "\n"
+"  --param-file=fname, -F fname\n"
+"      use the hardware volume control of the sound device. The file\n"
+"      fname has the same format as for 'volrace': it contains the\n"
+"      volume as floating point factor (e.g., '0.5' for an attenuation\n"
+"      of 6dB), further values in the file (RACE parameters) are\n"
+"      ignored. The file is checked about ten times per second and when\n"
+"      it was changed the volume is faded to the new value. This way the\n"
+"      software chain can pass the samples unchanged and no 'volrace'\n"
+"      process is needed for volume control. A negative volume cannot\n"
+"      be realized by the hardware, its absolute value is used.\n"
+"\n"
+"  --mixer-control=name, -C name\n"
+"      the name of the mixer control used with --param-file, see the\n"
+"      output of 'amixer scontrols'. Default is 'PCM'.\n"
+"\n"
+"  --mixer-device=name, -A name\n"
+"      the mixer device used with --param-file. The default is derived\n"
+"      from --device (e.g., 'hw:0' for the device 'hw:0,0').\n"
+"\n"
+"  --max-volume=floatval, -Q floatval\n"
+"      just for security, a volume from --param-file with an absolute\n"
+"      value larger than this is not used. Default is 1.0.\n"
+"\n"
+"  --fading-length=intval, -l intval\n"
+"      number of frames used for fading to a new volume. Default is\n"
+"      the sample rate (that is, one second).\n"
+"\n"
+"  --record-file=fname, -T fname\n"
+"      record for each loop the intended wakeup time, the wakeup error,\n"
+"      the space available in the hardware buffer in frames (with --mmap,\n"
+"      otherwise the fill of the input buffer in bytes), and the number\n"
+"      of bytes read and written. The records are kept in memory and\n"
+"      written to fname when the program ends and on SIGUSR1 (without\n"
+"      stopping). SIGINT and SIGTERM end the loop as the stop command of\n"
+"      'hrtctl' (a second one ends the program at once). If fname ends\n"
+"      in '.csv' a text file with comma separated values is written,\n"
+"      otherwise a compact binary file (see looprec.h).\n"
+"\n"
+"  --record-loops=intval, -U intval\n"
+"      the number of most recent loops kept with --record-file.\n"
+"      Default is 100000.\n"
+"\n"
+"  --control-shm=/name, -Y /name\n"
+"      create a small shared memory page with this name which is checked\n"
+"      once per loop. With the utility 'hrtctl' it can be used to change\n"
+"      --extra-bytes-per-second or the verbosity, to switch statistics\n"
+"      and recording on and off, to get a snapshot of statistics, or to\n"
+"      drain the sound device and stop while the program is running.\n"
+"      Furthermore, the current output latency (the time until a sample\n"
+"      given to playhrt reaches the DAC, computed from the delay of the\n"
+"      sound device and the fill of the internal buffer) is published\n"
+"      on this page in each loop; other programs can read it with\n"
+"      'hrtctl --latency' or the functions in 'ctlpage.h'.\n"
+"\n"
 "  --verbose, -v\n"
 "      print some information during startup and operation.\n"
 "      This option can be given twice for more output about timing\n"
@@ -231,6 +388,13 @@ void usage( ) {
 "          --loops-per-second=1000 --device=hw:0,0 --sample-rate=44100 \\\n"
 "          --sample-format=S16_LE --non-blocking --verbose \n"
 "\n"
+"  Using the hardware volume control of the sound device instead of\n"
+"  'volrace' (the file /tmp/VOLRACE contains the volume, e.g. '0.6'):\n"
+"\n"
+"  playhrt --mmap --stdin --device=hw:0,0 --sample-rate=192000 \\\n"
+"          --sample-format=S32_LE --param-file=/tmp/VOLRACE \\\n"
+"          --mixer-control=Digital --non-blocking --verbose\n"
+"\n"
 "  Without the --mmap option playhrt can buffer the input data, and the\n"
 "  size of the buffer can be chosen via the --buffer-size option.\n"
 "\n"
@@ -262,25 +426,626 @@ void usage( ) {
 );
 }
 
+/* memory mapped input file, see --file */
+static char *fmem = NULL;
+static long long flen, fpos;
+
+/* map and lock the input file, returns the file descriptor */
+int mapinput(char *fname, int shm, int verbose) {
+  int fd;
+  struct stat sb;
+
+  if (shm)
+      fd = shm_open(fname, O_RDONLY, 0);
+  else
+      fd = open(fname, O_RDONLY);
+  if (fd == -1) {
+      fprintf(stderr, "playhrt: Cannot open input file %s.\n", fname);
+      exit(28);
+  }
+  if (fstat(fd, &sb) == -1) {
+      fprintf(stderr, "playhrt: Cannot stat input file %s.\n", fname);
+      exit(28);
+  }
+  flen = sb.st_size;
+  fpos = 0;
+  if (flen == 0)
+      return fd;
+  fmem = mmap(NULL, flen, PROT_READ, MAP_SHARED | MAP_POPULATE, fd, 0);
+  if (fmem == MAP_FAILED) {
+      fprintf(stderr, "playhrt: Cannot map input file %s.\n", fname);
+      exit(29);
+  }
+  madvise(fmem, flen, MADV_SEQUENTIAL);
+  if (mlock(fmem, flen) == -1 && verbose)
+      fprintf(stderr, "playhrt: Cannot lock input file in memory, continuing.\n");
+  if (verbose)
+      fprintf(stderr, "playhrt: Mapped input file %s (%lld bytes).\n", fname, flen);
+  return fd;
+}
+
+/* framed input from 'bufhrt --framed', see frame.h */
+static int framed = 0;
+static long frem = 0;
+static unsigned long long nextseq = 0;
+static long long lastdelta, gaps = 0, lostframes = 0, nframes = 0;
+static struct hist lathist, jithist;
+
+/* read the next frame header, returns 0 at end of input */
+int readframe(int fd) {
+  struct framehdr hdr;
+  struct timespec t;
+  long long delta;
+  size_t got;
+  ssize_t s;
+
+  for (got = 0; got < sizeof(hdr); got += s) {
+      s = read(fd, (char*)&hdr + got, sizeof(hdr) - got);
+      if (s < 0) {
+          fprintf(stderr, "playhrt: Read error.\n");
+          exit(20);
+      }
+      if (s == 0)
+          return 0;
+  }
+  clock_gettime(hdr.clock == FRAME_TAI ? CLOCK_TAI : CLOCK_MONOTONIC, &t);
+  if (hdr.magic != FRAME_MAGIC) {
+      fprintf(stderr, "playhrt: Lost frame synchronization in input "
+                      "(is 'bufhrt' called with --framed?).\n");
+      exit(30);
+  }
+  /* one way latency and its change since the previous frame */
+  delta = t.tv_sec*1000000000LL + t.tv_nsec - hdr.tsend;
+  hist_add(&lathist, delta);
+  if (nframes > 0)
+      hist_add(&jithist, delta > lastdelta ? delta-lastdelta : lastdelta-delta);
+  lastdelta = delta;
+  if (nframes > 0 && hdr.seq != nextseq) {
+      gaps++;
+      lostframes += hdr.seq - nextseq;
+  }
+  nextseq = hdr.seq + 1;
+  nframes++;
+  frem = hdr.len;
+  return 1;
+}
+
+/* read up to n bytes of payload from frames, we only wait for more
+   frames as long as nothing was read */
+ssize_t getframed(int fd, char *ptr, size_t n) {
+  struct pollfd pfd;
+  size_t got, want;
+  ssize_t s;
+
+  for (got = 0; got < n; ) {
+      if (frem == 0) {
+          if (got > 0) {
+              pfd.fd = fd;
+              pfd.events = POLLIN;
+              if (poll(&pfd, 1, 0) <= 0)
+                  break;
+          }
+          if (readframe(fd) == 0)
+              break;
+          continue;
+      }
+      want = (n - got < frem) ? n - got : frem;
+      s = read(fd, ptr + got, want);
+      if (s < 0)
+          return got > 0 ? got : s;
+      if (s == 0)
+          break;
+      got += s;
+      frem -= s;
+      if (s < want)
+          break;
+  }
+  return got;
+}
+
+void framestats() {
+  fprintf(stderr, "playhrt: Frames: %lld, gaps: %lld (%lld frames lost).\n",
+          nframes, gaps, lostframes);
+  hist_print("playhrt", "Frame latency", &lathist);
+  hist_print("playhrt", "Frame jitter", &jithist);
+}
+
+/* multicast input, see mcast.h */
+static struct mcast *mc = NULL;
+
+/* kernel timestamps of the input, see --rx-timestamps */
+static int rxstamp = 0;
+static struct tstamp rxts;
+
+/* read up to n bytes of input into ptr, with read(2) or by copying from
+   the mapped input file */
+ssize_t getinput(int fd, void *ptr, size_t n) {
+  if (mc != NULL)
+      return mcast_read(mc, ptr, n);
+  if (framed)
+      return getframed(fd, ptr, n);
+  if (rxstamp)
+      return tstamp_recv(&rxts, fd, ptr, n, 0);
+  if (fmem == NULL)
+      return read(fd, ptr, n);
+  if (n > flen - fpos)
+      n = flen - fpos;
+  memcpy(ptr, fmem+fpos, n);
+  fpos += n;
+  return n;
+}
+
+/* shared timeline of several players, see --clock-sync and clocksync.h;
+   the stream position of a byte is syncpos + ocount */
+static struct clocksync *clk = NULL;
+static long long syncpos = 0, syncsec = 0;
+/* playout: the frame heard now should be the one of master time now;
+   the last SYNCERRS errors are averaged, synccorr frames are still to be
+   skipped (> 0) or repeated (< 0) */
+#define SYNCERRS 10
+static long long syncerr[SYNCERRS], syncsum, syncn, synccorr;
+static long long syncskipped, syncrepeated;
+static long long synclocal, syncheard;
+static int synclocked = 0;
+static struct hist synchist;
+
+/* master time now */
+long long syncnow()
+{
+    struct timespec t;
+
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    clocksync_convert(clk, &t, 0);
+    return t.tv_sec*1000000000LL + t.tv_nsec;
+}
+
+/* skip the input which we cannot write in time, after lead nsec */
+void syncinput(int bytesperframe, long long lead, int verbose)
+{
+    char buf[16*MCAST_PAYLOAD];
+    long long pos, late, start, d, skipped;
+    ssize_t s;
+
+    start = syncnow();
+    skipped = 0;
+    while ((pos = mcast_position(mc)) >= 0) {
+        late = syncnow() + lead - clocksync_playtime(clk, pos);
+        if (late <= 0)
+            break;
+        /* new data arrive as fast as we skip them */
+        if (syncnow() - start > 2000000000LL) {
+            fprintf(stderr, "playhrt: Delay of --clock-sync too small.\n");
+            exit(93);
+        }
+        d = (llround(late*1e-9*clk->refrate)/bytesperframe + 1)*bytesperframe;
+        if (d > sizeof(buf))
+            d = sizeof(buf);
+        if ((s = mcast_read(mc, buf, d)) <= 0)
+            break;
+        skipped += s;
+    }
+    if (verbose)
+        fprintf(stderr, "playhrt: Clock sync: skipped %lld bytes of input, "
+                        "starting at byte %lld of the stream.\n", skipped,
+                        pos);
+}
+
+/* the loop starts with the byte at position pos of the stream, it is
+   heard about outlat nsec after it is written */
+void syncloop(struct pacing *pc, long long pos, long long ocount,
+              long long outlat)
+{
+    long long t;
+
+    t = clocksync_playtime(clk, pos) - outlat;
+    if (t < syncnow()) {
+        fprintf(stderr, "playhrt: Delay of --clock-sync too small.\n");
+        exit(93);
+    }
+    /* the first step leads to t */
+    t -= pc->q;
+    pc->next.tv_sec = t/1000000000LL;
+    pc->next.tv_nsec = t%1000000000LL;
+    pc->racc = 0;
+    syncpos = pos - ocount;
+}
+
+/* with -v -v: local time when every 10 seconds of the stream are
+   heard, to compare several players on the same machine */
+void syncreport(long bytespersec)
+{
+    struct timespec t;
+    long long sec, b, l;
+
+    sec = syncheard/(10LL*bytespersec);
+    if (sec <= syncsec)
+        return;
+    syncsec = sec;
+    b = sec*10LL*bytespersec;
+    l = synclocal + (b - syncheard)*1000000000LL/bytespersec;
+    t.tv_sec = l/1000000000LL;
+    t.tv_nsec = l%1000000000LL;
+    fprintf(stderr, "playhrt: Clock sync: byte %lld of the stream heard at "
+                    "%ld.%09ld.\n", b, t.tv_sec, t.tv_nsec);
+}
+
+/* the sound device runs with its own clock: which byte of the stream is
+   heard now (the delay of the device is the number of frames written
+   but not yet played), and when should it be heard in master time? The
+   average error of the last measurements becomes frames to skip or
+   repeat, which also shifts the errors measured before */
+void syncplayout(snd_pcm_t *pcm, long long ocount, int bytesperframe,
+                 int rate, int verbose)
+{
+    snd_pcm_sframes_t delay;
+    struct timespec t;
+    long long err, d;
+    int i;
+
+    if (snd_pcm_state(pcm) != SND_PCM_STATE_RUNNING ||
+        snd_pcm_delay(pcm, &delay) < 0)
+        return;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    synclocal = t.tv_sec*1000000000LL + t.tv_nsec;
+    clocksync_convert(clk, &t, 0);
+    syncheard = syncpos + ocount - delay*bytesperframe;
+    err = t.tv_sec*1000000000LL + t.tv_nsec -
+          clocksync_playtime(clk, syncheard);
+    if (synclocked)
+        hist_add(&synchist, err < 0 ? -err : err);
+    if (verbose > 1)
+        syncreport(rate*bytesperframe);
+    /* a correction is under way */
+    if (synccorr != 0)
+        return;
+    syncsum += err - syncerr[syncn % SYNCERRS];
+    syncerr[syncn % SYNCERRS] = err;
+    if (++syncn < SYNCERRS)
+        return;
+    synccorr = llround(syncsum*1e-9/SYNCERRS*rate);
+    d = llround(synccorr*1e9/rate);
+    for (i = 0; i < SYNCERRS; i++)
+        syncerr[i] -= d;
+    syncsum -= SYNCERRS*d;
+    if (synccorr == 0 && !synclocked) {
+        synclocked = 1;
+        if (verbose)
+            fprintf(stderr, "playhrt: Clock sync: playout locked to the "
+                            "master.\n");
+    }
+}
+
+/* --mmap mode: read n bytes of input into ptr, with a frame skipped or
+   repeated if the playout must be corrected */
+ssize_t syncread(int fd, char *ptr, size_t n, int bytesperframe)
+{
+    ssize_t s, got;
+
+    if (synccorr > 0) {
+        for (got = 0; got < bytesperframe; got += s)
+            if ((s = getinput(fd, ptr, bytesperframe - got)) <= 0)
+                return s;
+        syncpos += bytesperframe;
+        synccorr--;
+        syncskipped++;
+    } else if (synccorr < 0 && n >= 2*bytesperframe) {
+        s = getinput(fd, ptr, n - bytesperframe);
+        if (s != n - bytesperframe)
+            return s;
+        memcpy(ptr + s, ptr + s - bytesperframe, bytesperframe);
+        syncpos -= bytesperframe;
+        synccorr++;
+        syncrepeated++;
+        return n;
+    }
+    return getinput(fd, ptr, n);
+}
+
+void syncstats()
+{
+    fprintf(stderr, "playhrt: Clock sync: %lld frames skipped and %lld "
+                    "repeated to follow the master.\n", syncskipped,
+                    syncrepeated);
+    hist_print("playhrt", "Playout error", &synchist);
+}
+
+/* hardware volume control via the ALSA mixer, the volume is read from
+   a parameter file in the format used by 'volrace' */
+static char *volfile = NULL;
+static snd_mixer_elem_t *mixelem = NULL;
+static long mixmin, mixmax, mixlast, volcheck, fadecount, fadelen;
+static int mixdb, volverbose;
+static double vol, nvol, vdiff, maxvol, ptime;
+
+/* utility to get modification time of a file in nsec precision */
+double mtimens(char* fnam) {
+  struct stat sb;
+  if (stat(fnam, &sb) == -1)
+     return 0.0;
+  else
+    return (double)sb.st_mtim.tv_sec + (double) sb.st_mtim.tv_nsec*0.000000001;
+}
+
+/* read volume from file, use init==1 during initialization, program will
+   terminate in case of problem; later use init==0, if a problem occurs the
+   volume is left as it is */
+int getvolume(char* fnam, double* vp, int init) {
+  FILE* params;
+  int ok;
+  params = fopen(fnam, "r");
+  if (!params) {
+     if (init) {
+       fprintf(stderr, "playhrt: Cannot open %s.\n", fnam);
+       exit(24);
+     } else
+       return 0;
+  }
+  ok = fscanf(params, "%lf", vp);
+  fclose(params);
+  if (ok == EOF || ok == 0) {
+     if (init) {
+       fprintf(stderr, "playhrt: Cannot read volume from %s.\n", fnam);
+       exit(25);
+     } else
+       return 0;
+  }
+  if (*vp < -maxvol || *vp > maxvol) {
+     fprintf(stderr, "playhrt: Invalid volume, using %.4f.\n", 0.01*maxvol);
+     *vp = 0.01*maxvol;
+  }
+  if (*vp < 0.0) {
+     if (volverbose)
+         fprintf(stderr, "playhrt: Cannot invert with hardware volume, using %.4f.\n", -*vp);
+     *vp = -*vp;
+  }
+  return 1;
+}
+
+/* find the mixer control, exits in case of problems */
+snd_mixer_elem_t* openmixer(char* mixname, char* ctlname) {
+  snd_mixer_t *mixer;
+  snd_mixer_selem_id_t *sid;
+  snd_mixer_elem_t *elem;
+
+  if (snd_mixer_open(&mixer, 0) < 0 ||
+      snd_mixer_attach(mixer, mixname) < 0 ||
+      snd_mixer_selem_register(mixer, NULL, NULL) < 0 ||
+      snd_mixer_load(mixer) < 0) {
+      fprintf(stderr, "playhrt: Cannot open mixer %s.\n", mixname);
+      exit(26);
+  }
+  snd_mixer_selem_id_malloc(&sid);
+  snd_mixer_selem_id_set_index(sid, 0);
+  snd_mixer_selem_id_set_name(sid, ctlname);
+  elem = snd_mixer_find_selem(mixer, sid);
+  snd_mixer_selem_id_free(sid);
+  if (elem == NULL || !snd_mixer_selem_has_playback_volume(elem)) {
+      fprintf(stderr, "playhrt: No volume control '%s' on mixer %s.\n",
+                      ctlname, mixname);
+      exit(27);
+  }
+  /* prefer dB scale, otherwise we map the volume linearly to the range */
+  if (snd_mixer_selem_get_playback_dB_range(elem, &mixmin, &mixmax) == 0 &&
+      mixmin < mixmax) {
+      mixdb = 1;
+  } else {
+      mixdb = 0;
+      snd_mixer_selem_get_playback_volume_range(elem, &mixmin, &mixmax);
+  }
+  mixlast = mixmin - 1;
+  return elem;
+}
+
+/* set hardware volume to factor v, only calls the mixer on change */
+void setmixervolume(double v) {
+  long val;
+  if (mixdb) {
+    /* in units of 1/100 dB */
+    val = (v > 0.0) ? (long)(2000.0*log10(v)) : mixmin;
+    if (val < mixmin)
+        val = mixmin;
+  } else
+    val = mixmin + (long)(v*(mixmax-mixmin));
+  if (val > mixmax)
+      val = mixmax;
+  if (val == mixlast)
+      return;
+  if (mixdb)
+      snd_mixer_selem_set_playback_dB_all(mixelem, val, 0);
+  else
+      snd_mixer_selem_set_playback_volume_all(mixelem, val);
+  if (snd_mixer_selem_has_playback_switch(mixelem)) {
+      if (val == mixmin && v == 0.0)
+          snd_mixer_selem_set_playback_switch_all(mixelem, 0);
+      else if (mixlast == mixmin || mixlast < mixmin)
+          snd_mixer_selem_set_playback_switch_all(mixelem, 1);
+  }
+  mixlast = val;
+}
+
+/* called once per loop after data were given to the sound device; while
+   fading we set the volume in each loop, otherwise the parameter file is
+   checked every volcheck loops */
+void updatevolume(long count, long frames) {
+  double ntime, v;
+  if (fadecount > 0) {
+      fadecount -= frames;
+      if (fadecount <= 0) {
+          fadecount = 0;
+          vol = nvol;
+      } else
+          vol = nvol - vdiff*fadecount;
+      setmixervolume(vol);
+      return;
+  }
+  if (count % volcheck != 0)
+      return;
+  ntime = mtimens(volfile);
+  if (ntime > ptime+0.00001 && getvolume(volfile, &v, 0)) {
+      ptime = ntime;
+      nvol = v;
+      fadecount = fadelen;
+      vdiff = (nvol-vol)/fadelen;
+      if (volverbose)
+          fprintf(stderr, "playhrt: Reread volume %.3f.\n", nvol);
+  }
+}
+
+/* runtime control page, see ctlpage.h */
+static struct ctlpage *ctl = NULL;
+static unsigned int ctlseq = 0;
+
+/* handle commands from the control page, the statistics are only
+   used for a snapshot, returns 1 if we should stop */
+int docontrol(int bytesperframe, double *extrabps, struct pacing *pc,
+              int *verbose, int *dostats, int *record,
+              int canrecord, long long loops, long long icount,
+              long long ocount, long delayed, long badreads, long badloops,
+              long fill)
+{
+    unsigned int cmd;
+
+    cmd = ctlpage_cmd(ctl, &ctlseq);
+    if (cmd & CTL_EXTRA) {
+        *extrabps = ctl->extrabps;
+        pace_extra(pc, *extrabps/bytesperframe);
+        if (*verbose)
+            fprintf(stderr, "playhrt: Control: %.3f extra bytes per second, "
+                            "step size %ld nsec.\n", *extrabps, pc->nsec);
+    }
+    if (cmd & CTL_VERBOSE)
+        *verbose = ctl->verbose;
+    if (cmd & CTL_STATS) {
+        *dostats = ctl->stats;
+        *record = canrecord && ctl->stats;
+        pc->stats = ctl->stats;
+    }
+    /* the wakeup times are measured only with -v -v */
+    if ((cmd & (CTL_VERBOSE | CTL_STATS)) && pc->stats)
+        pc->stats = (*verbose > 1) ? 2 : 1;
+    if (cmd & CTL_SNAPSHOT) {
+        ctl->loops = loops;
+        ctl->inbytes = icount;
+        ctl->outbytes = ocount;
+        ctl->delayed = delayed;
+        ctl->badreads = badreads;
+        ctl->badwrites = badloops;
+        ctl->fill = fill;
+        ctl->nsec = pc->nsec;
+        ctl->curextrabps = *extrabps;
+        ctlpage_snapdone(ctl, ctlseq);
+    }
+    if ((cmd & CTL_STOP) && *verbose)
+        fprintf(stderr, "playhrt: Control: stopping.\n");
+    return (cmd & CTL_STOP) ? 1 : 0;
+}
+
+/* publish the current output latency on the control page, frames in the
+   sound device (also those queued in hardware) and in our own buffer */
+void setlatency(snd_pcm_t *pcm, long buffered, int rate,
+                struct timespec *t, long long *latmin, long long *latmax)
+{
+    snd_pcm_sframes_t delay;
+
+    if (snd_pcm_delay(pcm, &delay) < 0)
+        return;
+    ctlpage_setlatency(ctl, t->tv_sec*1000000000LL+t->tv_nsec,
+                       delay, buffered, rate);
+    if (ctl->latency < *latmin)
+        *latmin = ctl->latency;
+    if (ctl->latency > *latmax)
+        *latmax = ctl->latency;
+}
+
+/* receiver driven rate control, see --feedback and feedback.h */
+static int feedback = 0;
+static struct fbstate fbs;
+static unsigned int fbseq = 0;
+
+/* send a report with the current fill (bytes in the sound device, in
+   our buffer and in the receive queue of the socket) back to 'bufhrt' */
+void sendfeedback(int fd, snd_pcm_t *pcm, long buffered, int bytesperframe,
+                  struct timespec *t)
+{
+    struct feedback fb;
+    snd_pcm_sframes_t delay;
+    int inq;
+
+    if (snd_pcm_delay(pcm, &delay) < 0 || ioctl(fd, FIONREAD, &inq) < 0)
+        return;
+    fb.magic = FEEDBACK_MAGIC;
+    fb.seq = fbseq++;
+    fb.time = t->tv_sec*1000000000LL + t->tv_nsec;
+    fb.fill = delay*bytesperframe + buffered + inq;
+    feedback_update(&fbs, fb.time, fb.fill);
+    fb.drift = fbs.drift;
+    send(fd, &fb, sizeof(fb), MSG_DONTWAIT | MSG_NOSIGNAL);
+}
+
+/* the sink for the timed loop in RW mode: write frames to the sound
+   device, after an error recover and restart the timeline */
+struct pcmsink {
+    snd_pcm_t *pcm;
+    struct pacing *pc;
+    int *verbose;
+};
+
+ssize_t pcmwrite(void *arg, void *ptr, size_t len)
+{
+    struct pcmsink *ps = arg;
+    snd_pcm_sframes_t s;
+
+#ifdef ALSANC
+    /* here we use snd_pcm_writei_nc (if available in patched ALSA
+       library. This avoids some error checks and high cpu usage with
+       small hardware buffer sizes */
+    s = snd_pcm_writei_nc(ps->pcm, ptr, len);
+#else
+    /* otherwise we use the standard snd_pcm_writei  */
+    s = snd_pcm_writei(ps->pcm, ptr, len);
+#endif
+    while (s < 0) {
+        s = snd_pcm_recover(ps->pcm, s, 0);
+        if (s < 0) {
+            snd_pcm_prepare(ps->pcm);
+            fprintf(stderr, "playhrt: <<<<< Cannot write, resetted >>>>\n");
+        }
+        pace_start(ps->pc);
+        if (*ps->verbose)
+           fprintf(stderr, "playhrt: Bad write at (%ld sec %ld nsec).\n",
+                   ps->pc->next.tv_sec, ps->pc->next.tv_nsec);
+#ifdef ALSANC
+        s = snd_pcm_writei_nc(ps->pcm, ptr, len);
+#else
+        s = snd_pcm_writei(ps->pcm, ptr, len);
+#endif
+    }
+    return s;
+}
 
 int main(int argc, char *argv[])
 {
     int sfd, s, moreinput, err, verbose, nrchannels, startcount, sumavg,
-        innetbufsize, dobufstats, countdelay, maxbad;
-    long blen, hlen, ilen, olen, extra, loopspersec, nrdelays, sleep,
-         nsec, count, wnext, badloops, badreads, readmissing, avgav, checkav;
-    long long icount, ocount, badframes;
+        innetbufsize, dobufstats, countdelay, maxbad, faststart, readloops,
+        record;
+    long blen, hlen, ilen, olen, extra, loopspersec, sleep,
+         count, wnext, badloops, badreads, readmissing, avgav, checkav,
+         prefill, nrecs, rd, wr, fbloops, under;
+    long long icount, ocount, badframes, nreads, latmin, latmax, outlat;
     void *buf, *iptr, *optr, *max;
     struct timespec mtime;
-    struct timespec mtimecheck;
-    double looperr, off, extraerr, extrabps, morebps;
+    struct timespec mtimestart;
+    double extrabps, morebps;
+    struct pacing pc;
+    struct pcmsink psink;
     snd_pcm_t *pcm_handle;
     snd_pcm_hw_params_t *hwparams;
     snd_pcm_sw_params_t *swparams;
     snd_pcm_format_t format;
-    char *host, *port, *pcm_name;
-    int optc, nonblock, rate, bytespersample, bytesperframe;
-    snd_pcm_uframes_t hwbufsize, periodsize, offset, frames;
+    char *host, *port, *pcm_name, *mixname, *ctlname, *recfile, *ctlshm;
+    char *infile, *mcname, *clkname, *clkoffset;
+    int optc, inshm, nonblock, rate, bytespersample, bytesperframe;
+    snd_pcm_uframes_t hwbufsize, periodsize, offset, frames, want;
     snd_pcm_access_t access;
     snd_pcm_sframes_t avail;
     const snd_pcm_channel_area_t *areas;
@@ -292,8 +1057,17 @@ int main(int argc, char *argv[])
         {"host", required_argument, 0,  'r' },
         {"port", required_argument,       0,  'p' },
         {"stdin", no_argument,       0,  'S' },
+        {"file", required_argument,       0,  'I' },
+        {"framed", no_argument,       0,  'E' },
+        {"feedback", no_argument,       0,  'B' },
+        {"multicast", required_argument, 0, 'G' },
+        {"clock-sync", required_argument, 0, 'a' },
+        {"clock-offset", required_argument, 0, 'g' },
+        {"rx-timestamps", no_argument, 0, 't' },
+        {"shmname", required_argument,       0,  'W' },
         {"buffer-size", required_argument,       0,  'b' },
         {"input-size",  required_argument, 0, 'i'},
+        {"loops-per-read", required_argument, 0, 'R' },
         {"loops-per-second", required_argument, 0,  'n' },
         {"sample-rate", required_argument, 0,  's' },
         {"sample-format", required_argument, 0, 'f' },
@@ -304,6 +1078,15 @@ int main(int argc, char *argv[])
         {"device", required_argument, 0, 'd' },
         {"extra-bytes-per-second", required_argument, 0, 'e' },
         {"sleep", required_argument, 0, 'D' },
+        {"fast-start", no_argument, 0, 'X' },
+        {"param-file", required_argument, 0, 'F' },
+        {"mixer-control", required_argument, 0, 'C' },
+        {"mixer-device", required_argument, 0, 'A' },
+        {"max-volume", required_argument, 0, 'Q' },
+        {"fading-length", required_argument, 0, 'l' },
+        {"record-file", required_argument, 0, 'T' },
+        {"record-loops", required_argument, 0, 'U' },
+        {"control-shm", required_argument, 0, 'Y' },
         {"max-bad-reads", required_argument, 0, 'm' },
         {"in-net-buffer-size", required_argument, 0, 'K' },
         {"extra-frames-out", required_argument, 0, 'o' },
@@ -343,11 +1126,27 @@ int main(int argc, char *argv[])
     maxbad = 4;
     nonblock = 0;
     innetbufsize = 0;
+    mcname = NULL;
+    clkname = NULL;
+    clkoffset = NULL;
     corr = 0;
     verbose = 0;
     dobufstats = 1;
     countdelay = 1;
-    while ((optc = getopt_long(argc, argv, "r:p:Sb:i:n:s:f:k:Mc:P:d:e:o:NvVh",
+    faststart = 0;
+    readloops = 1;
+    mixname = NULL;
+    ctlname = "PCM";
+    maxvol = 1.0;
+    fadelen = 0;
+    recfile = NULL;
+    nrecs = 100000;
+    ctlshm = NULL;
+    latmin = 1LL<<62;
+    latmax = 0;
+    infile = NULL;
+    inshm = 0;
+    while ((optc = getopt_long(argc, argv, "r:p:SI:W:EBG:b:i:R:n:s:f:k:Mc:P:d:e:o:NXF:C:A:Q:l:T:U:Y:vVh",
             longoptions, &optind)) != -1) {
         switch (optc) {
         case 'r':
@@ -359,12 +1158,46 @@ int main(int argc, char *argv[])
         case 'S':
           sfd = 0;
           break;
+        case 'I':
+          infile = optarg;
+          inshm = 0;
+          break;
+        case 'B':
+          feedback = 1;
+          break;
+        case 'G':
+          mcname = optarg;
+          break;
+        case 'a':
+          clkname = optarg;
+          break;
+        case 'g':
+          clkoffset = optarg;
+          break;
+        case 't':
+          rxstamp = 1;
+          tstamp_init(&rxts, "playhrt");
+          break;
+        case 'E':
+          framed = 1;
+          hist_init(&lathist);
+          hist_init(&jithist);
+          break;
+        case 'W':
+          infile = optarg;
+          inshm = 1;
+          break;
         case 'b':
           blen = atoi(optarg);
           break;
         case 'i':
           ilen = atoi(optarg);
           break;
+        case 'R':
+          readloops = atoi(optarg);
+          if (readloops < 1)
+              readloops = 1;
+          break;
         case 'n':
           loopspersec = atoi(optarg);
           break;
@@ -410,6 +1243,33 @@ int main(int argc, char *argv[])
         case 'D':
           sleep = atoi(optarg);
           break;
+        case 'X':
+          faststart = 1;
+          break;
+        case 'F':
+          volfile = optarg;
+          break;
+        case 'C':
+          ctlname = optarg;
+          break;
+        case 'A':
+          mixname = optarg;
+          break;
+        case 'Q':
+          maxvol = atof(optarg);
+          break;
+        case 'l':
+          fadelen = atoi(optarg);
+          break;
+        case 'T':
+          recfile = optarg;
+          break;
+        case 'U':
+          nrecs = atoi(optarg);
+          break;
+        case 'Y':
+          ctlshm = optarg;
+          break;
         case 'm':
           maxbad = atoi(optarg);
           break;
@@ -451,21 +1311,50 @@ int main(int argc, char *argv[])
     }
     bytesperframe = bytespersample*nrchannels;
     /* check some arguments and set some parameters */
-    if ((host == NULL || port == NULL) && sfd < 0) {
-       fprintf(stderr, "playhrt: Must specify --host and --port or --stdin.\n");
+    if (infile != NULL)
+       sfd = mapinput(infile, inshm, verbose);
+    /* a local socket needs no port */
+    if (fd_isunix(host) && port == NULL)
+       port = host;
+    if (feedback && (host == NULL || port == NULL || infile != NULL)) {
+       fprintf(stderr, "playhrt: --feedback needs --host and --port.\n");
+       exit(3);
+    }
+    if (mcname != NULL && (host != NULL || sfd >= 0 || framed || feedback)) {
+       fprintf(stderr, "playhrt: --multicast is not possible with --host, "
+                       "--stdin, --file, --framed or --feedback.\n");
+       exit(3);
+    }
+    if (clkname != NULL && mcname == NULL) {
+       fprintf(stderr, "playhrt: --clock-sync needs --multicast.\n");
        exit(3);
     }
-    /* compute nanoseconds per loop (wrt local clock) */
-    extraerr = 1.0*bytesperframe*rate;
-    extraerr = extraerr/(extraerr+extrabps);
-    nsec = (int) (1000000000*extraerr/loopspersec);
+    if (rxstamp && (framed || ((host == NULL || port == NULL || sfd >= 0) &&
+                               mcname == NULL))) {
+       fprintf(stderr, "playhrt: --rx-timestamps needs --host and --port or "
+                       "--multicast, and not --framed.\n");
+       exit(3);
+    }
+    if ((host == NULL || port == NULL) && sfd < 0 && mcname == NULL) {
+       fprintf(stderr, "playhrt: Must specify --host and --port, --stdin or --file.\n");
+       exit(3);
+    }
+    /* nanoseconds per loop (wrt local clock) and olen in frames written
+       per loop; the wakeup times are only measured with -v -v, this
+       needs a clock_gettime call between the wakeup and the write */
+    if (countdelay && verbose > 1)
+        countdelay = 2;
+    pace_init(&pc, "playhrt", rate, loopspersec, extrabps/bytesperframe,
+              countdelay);
+    pc.record = &record;
     if (verbose) {
-        fprintf(stderr, "playhrt: Step size is %ld nsec.\n", nsec);
+        fprintf(stderr, "playhrt: Step size is %ld nsec.\n", pc.nsec);
     }
-    /* olen in frames written per loop */
-    olen = rate/loopspersec;
-    if (olen <= 0)
-        olen = 1;
+    olen = pc.size;
+    /* about ten feedback reports per second */
+    fbloops = loopspersec/10;
+    if (fbloops < 1)
+        fbloops = 1;
     if (ilen < bytesperframe*(olen)) {
         if (olen*loopspersec == rate)
             ilen = bytesperframe * olen;
@@ -474,23 +1363,33 @@ int main(int argc, char *argv[])
         if (verbose)
             fprintf(stderr, "playhrt: Setting input chunk size to %ld bytes.\n", ilen);
     }
+    /* with fewer reads we need larger chunks */
+    if (readloops > 1 && ilen < readloops*bytesperframe*(olen+1)) {
+        ilen = readloops*bytesperframe*(olen+1);
+        if (verbose)
+            fprintf(stderr, "playhrt: Reading every %d loops, input chunk size %ld bytes.\n",
+                            readloops, ilen);
+    }
     /* need big enough input buffer */
     if (blen < 3*ilen) {
         blen = 3*ilen;
     }
     hlen = blen/2;
-    if (olen*loopspersec == rate)
-        looperr = 0.0;
-    else
-        looperr = (1.0*rate)/loopspersec - 1.0*olen;
     moreinput = 1;
     icount = 0;
     ocount = 0;
+    nreads = 0;
     /* for mmap try to set hwbuffer to multiple of output per loop */
     if (access == SND_PCM_ACCESS_MMAP_INTERLEAVED) {
         hwbufsize = hwbufsize - (hwbufsize % olen);
     }
 
+    record = (recfile != NULL);
+    if (record)
+        looprec_init("playhrt", recfile, nrecs);
+    if (ctlshm != NULL)
+        ctl = ctlpage_open("playhrt", ctlshm);
+
     /* need blen plus some overlap for (circular) input buffer */
     if (! (buf = malloc(blen+ilen+(olen+extra)*bytesperframe)) ) {
         fprintf(stderr, "playhrt: Cannot allocate buffer of length %ld.\n",
@@ -509,7 +1408,7 @@ int main(int argc, char *argv[])
     optr = buf;
 
     /* setup network connection */
-    if (host != NULL && port != NULL) {
+    if (host != NULL && port != NULL && infile == NULL) {
         sfd = fd_net(host, port);
         if (innetbufsize != 0) {
             if (setsockopt(sfd, SOL_SOCKET, SO_RCVBUF, (void*)&innetbufsize, sizeof(int)) < 0) {
@@ -518,6 +1417,31 @@ int main(int argc, char *argv[])
                 exit(23);
             }
         }
+        if (rxstamp)
+            tstamp_rx(&rxts, sfd, rate*bytesperframe, 0);
+    } else if (mcname != NULL) {
+        mc = mcast_receiver("playhrt", mcname, innetbufsize, verbose);
+        sfd = mc->fd;
+        if (rxstamp) {
+            tstamp_rx(&rxts, sfd, rate*bytesperframe,
+                      sizeof(struct mcasthdr));
+            mc->ts = &rxts;
+        }
+    }
+    /* the loop runs in the time of the master, with its speed */
+    if (clkname != NULL) {
+        clk = clocksync_slave("playhrt", clkname, clkoffset, verbose);
+        if (!clocksync_wait(clk, 5000)) {
+            fprintf(stderr, "playhrt: No answer from clock master %s.\n",
+                    clkname);
+            exit(93);
+        }
+        pc.clock = clocksync_convert;
+        pc.clockarg = clk;
+        pace_extra(&pc, clk->refrate/bytesperframe - rate);
+        if (verbose)
+            fprintf(stderr, "playhrt: Clock sync: offset %.3f msec, step "
+                            "size %ld nsec.\n", clk->off/1000000.0, pc.nsec);
     }
 
     /* setup sound device */
@@ -605,12 +1529,38 @@ int main(int argc, char *argv[])
     }
     snd_pcm_sw_params_free (swparams);
 
+    /* setup hardware volume control */
+    if (volfile != NULL) {
+        volverbose = verbose;
+        if (mixname == NULL) {
+            /* "hw:0,0" -> "hw:0" */
+            if (pcm_name != NULL) {
+                mixname = strdup(pcm_name);
+                if (strchr(mixname, ',') != NULL)
+                    *strchr(mixname, ',') = '\0';
+            } else
+                mixname = "default";
+        }
+        mixelem = openmixer(mixname, ctlname);
+        getvolume(volfile, &vol, 1);
+        ptime = mtimens(volfile);
+        setmixervolume(vol);
+        if (fadelen <= 0)
+            fadelen = rate;
+        volcheck = loopspersec/10;
+        if (volcheck <= 0)
+            volcheck = 1;
+        fadecount = 0;
+        if (verbose)
+            fprintf(stderr, "playhrt: Hardware volume %.3f (control '%s' on %s, %s).\n",
+                            vol, ctlname, mixname, mixdb ? "dB scale" : "linear");
+    }
+
     /* main loop */
     badloops = 0;
     badframes = 0;
     badreads = 0;
     readmissing = 0;
-    nrdelays = 0;
 
     /* short delay to allow input to fill buffer */
     if (sleep > 0) {
@@ -619,11 +1569,24 @@ int main(int argc, char *argv[])
       nanosleep(&mtime, NULL);
     }
 
+    /* the input read before the loop starts must arrive in time, too */
+    if (clk != NULL) {
+      /* a written frame is heard after about half of the hwbuffer */
+      outlat = (hwbufsize/2)*1000000000LL/rate;
+      hist_init(&synchist);
+      if (access == SND_PCM_ACCESS_RW_INTERLEAVED)
+        s = 2*hlen - ilen;
+      else
+        s = (faststart ? hwbufsize/2 : 0)*bytesperframe;
+      syncinput(bytesperframe, 10000000LL + 2*pc.nsec + outlat +
+                               llround(s*1e9/clk->refrate), verbose);
+    }
+
     if (access == SND_PCM_ACCESS_RW_INTERLEAVED) {
       /* fill half buffer */
       for (; iptr < buf + 2*hlen - ilen; ) {
           memclean(iptr, ilen);
-          s = read(sfd, iptr, ilen);
+          s = getinput(sfd, iptr, ilen);
           if (s < 0) {
               fprintf(stderr, "playhrt: Read error.\n");
               exit(18);
@@ -640,78 +1603,73 @@ int main(int argc, char *argv[])
       else
           wnext = olen;
 
-      if (clock_gettime(CLOCK_MONOTONIC, &mtime) < 0) {
-          fprintf(stderr, "playhrt: Cannot get monotonic clock.\n");
-          exit(19);
-      }
+      pace_start(&pc);
+      if (clk != NULL)
+          syncloop(&pc, mcast_position(mc) - (iptr-optr), ocount, outlat);
       if (verbose)
          fprintf(stderr, "playhrt: Start time (%ld sec %ld nsec).\n",
-                         mtime.tv_sec, mtime.tv_nsec);
-      for (count=1, off=looperr; 1; count++, off+=looperr) {
+                         pc.next.tv_sec, pc.next.tv_nsec);
+      psink.pcm = pcm_handle;
+      psink.pc = &pc;
+      psink.verbose = &verbose;
+      for (count=1; 1; count++) {
           /* compute time for next wakeup */
-          mtime.tv_nsec += nsec;
-          if (mtime.tv_nsec > 999999999) {
-            mtime.tv_nsec -= 1000000000;
-            mtime.tv_sec++;
-          }
+          pace_step(&pc);
           refreshmem(optr, wnext*bytesperframe);
           refreshmem(optr, wnext*bytesperframe);
-          clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &mtime, NULL);
           /* write a chunk, this comes first immediately after waking up */
-#ifdef ALSANC
-          /* here we use snd_pcm_writei_nc (if available in patched ALSA
-             library. This avoids some error checks and high cpu usage with
-             small hardware buffer sizes */
-          s = snd_pcm_writei_nc(pcm_handle, optr, wnext);
-#else
-          /* otherwise we use the standard snd_pcm_writei  */
-          s = snd_pcm_writei(pcm_handle, optr, wnext);
-#endif
-          while (s < 0) {
-              s = snd_pcm_recover(pcm_handle, s, 0);
-              if (s < 0) {
-                  snd_pcm_prepare(pcm_handle);
-                  fprintf(stderr, "playhrt: <<<<< Cannot write, resetted >>>>\n");
-              }
-              clock_gettime(CLOCK_MONOTONIC, &mtime);
-              if (verbose)
-                 fprintf(stderr, "playhrt: Bad write at (%ld sec %ld nsec).\n",
-                         mtime.tv_sec, mtime.tv_nsec);
-#ifdef ALSANC
-              s = snd_pcm_writei_nc(pcm_handle, optr, wnext);
-#else
-              s = snd_pcm_writei(pcm_handle, optr, wnext);
-#endif
-          }
+          s = pace_write(&pc, pcmwrite, &psink, optr, wnext);
           /* we count output and bad loops */
           if (s < wnext) {
               badloops++;
               badframes += (wnext - s);
           }
           ocount += s*bytesperframe;
+          if (clk != NULL && count % fbloops == 0)
+              syncplayout(pcm_handle, ocount, bytesperframe, rate, verbose);
           optr += s*bytesperframe;
-          wnext = olen + wnext - s;
-          if (off >= 1.0) {
-             off -= 1.0;
-             wnext++;
-          }
-          if (wnext >= olen+extra) {
-             if (verbose)
-                fprintf(stderr, "playhrt: Underrun by %ld bytes at (%ld sec %ld nsec).\n",
-                        wnext - olen - extra, mtime.tv_sec, mtime.tv_nsec);
-             wnext = olen+extra-1;
-          }
+          wr = s*bytesperframe;
+          if (mixelem != NULL)
+              updatevolume(count, s);
+          if (ctl != NULL)
+              setlatency(pcm_handle, (iptr >= optr ? iptr-optr :
+                         iptr+blen-optr)/bytesperframe, rate, &pc.next,
+                         &latmin, &latmax);
+          if (feedback && count % fbloops == 0)
+              sendfeedback(sfd, pcm_handle, iptr >= optr ? iptr-optr :
+                           iptr+blen-optr, bytesperframe, &pc.next);
+          wnext = pace_size(&pc) + wnext - s;
+          if ((under = pace_clamp(&pc, &wnext, olen+extra)) > 0 && verbose)
+             fprintf(stderr, "playhrt: Underrun by %ld frames at (%ld sec %ld nsec).\n",
+                     under, pc.next.tv_sec, pc.next.tv_nsec);
           s = (iptr >= optr ? iptr - optr : iptr+blen-optr);
           if (s <= wnext*bytesperframe) {
               wnext = s/bytesperframe;
           }
+          /* follow the master at the output: skip or repeat one frame */
+          if (synccorr > 0 && s >= (wnext+1)*bytesperframe) {
+              optr += bytesperframe;
+              syncpos += bytesperframe;
+              synccorr--;
+              syncskipped++;
+          } else if (synccorr < 0 && ocount > 0 &&
+                     optr-bytesperframe >= buf-(olen+extra)*bytesperframe) {
+              optr -= bytesperframe;
+              syncpos -= bytesperframe;
+              synccorr++;
+              syncrepeated++;
+          }
           if (optr+wnext*bytesperframe >= max) {
               optr -= blen;
           }
-          /* read if buffer not half filled */
-          if (moreinput && (iptr > optr ? iptr-optr : iptr+blen-optr) < hlen) {
+          /* read if buffer not half filled (only every readloops loops) */
+          rd = 0;
+          if (moreinput && count % readloops == 0 &&
+              (iptr > optr ? iptr-optr : iptr+blen-optr) < hlen) {
               memclean(iptr, ilen);
-              s = read(sfd, iptr, ilen);
+              s = getinput(sfd, iptr, ilen);
+              rd = s;
+              nreads++;
               if (s < 0) {
                   fprintf(stderr, "playhrt: Read error.\n");
                   exit(20);
@@ -732,6 +1690,16 @@ int main(int argc, char *argv[])
                   moreinput = 0;
               }
           }
+          if (record)
+              looprec_add(iptr >= optr ? iptr-optr : iptr+blen-optr, rd, wr);
+          if (looprec_sig && looprec_check())
+              break;
+          if (ctl != NULL && ctl->seq != ctlseq &&
+              docontrol(bytesperframe, &extrabps, &pc,
+                        &verbose, &dobufstats, &record, recfile != NULL,
+                        count, icount, ocount, pc.delayed, badreads, badloops,
+                        iptr >= optr ? iptr-optr : iptr+blen-optr))
+              break;
           if (wnext == 0)
               break;    /* done */
       }
@@ -741,30 +1709,71 @@ int main(int argc, char *argv[])
      if (verbose)
          fprintf(stderr, "playhrt: Using mmap access.\n");
      startcount = hwbufsize/(2*olen);
-     if (clock_gettime(CLOCK_MONOTONIC, &mtime) < 0) {
-          fprintf(stderr, "playhrt: Cannot get monotonic clock.\n");
-          exit(19);
-      }
+     if (faststart) {
+         /* fill half of the hwbuffer in one burst as soon as input is
+            available and start playing immediately, the timeline is
+            anchored below after the start */
+         clock_gettime(CLOCK_MONOTONIC, &mtimestart);
+         for (prefill = 0; prefill < hwbufsize/2; ) {
+             frames = hwbufsize/2 - prefill;
+             snd_pcm_avail_update(pcm_handle);
+             err = snd_pcm_mmap_begin(pcm_handle, &areas, &offset, &frames);
+             if (err < 0) {
+                 fprintf(stderr, "playhrt: Don't get mmap address.\n");
+                 exit(21);
+             }
+             ilen = frames * bytesperframe;
+             iptr = areas[0].addr + offset * bytesperframe;
+             /* here we block until the whole chunk is read */
+             for (s = 0; s < ilen; s += err) {
+                 err = getinput(sfd, iptr+s, ilen-s);
+                 if (err < 0) {
+                     fprintf(stderr, "playhrt: Read error.\n");
+                     exit(22);
+                 }
+                 if (err == 0)
+                     break;
+             }
+             refreshmem(iptr, s);
+             snd_pcm_mmap_commit(pcm_handle, offset, s/bytesperframe);
+             icount += s;
+             ocount += s;
+             prefill += s/bytesperframe;
+             if (s < ilen) /* input complete */
+                 break;
+         }
+         snd_pcm_start(pcm_handle);
+         /* count never reaches this, so the loop does not start again */
+         startcount = 0;
+     }
+     pace_start(&pc);
+      if (clk != NULL)
+          syncloop(&pc, mcast_position(mc), ocount, outlat);
       if (verbose)
          fprintf(stderr, "playhrt: Start time (%ld sec %ld nsec).\n",
-                         mtime.tv_sec, mtime.tv_nsec);
+                         pc.next.tv_sec, pc.next.tv_nsec);
+      if (verbose && faststart)
+         fprintf(stderr, "playhrt: Fast start, %ld frames prefilled in %ld usec.\n",
+                 prefill, (pc.next.tv_sec-mtimestart.tv_sec)*1000000 +
+                          (pc.next.tv_nsec-mtimestart.tv_nsec)/1000);
       sumavg= 0;
       checktime = 0;
-      for (count=1, off=looperr; 1; count++, off+=looperr) {
+      for (count=1; 1; count++) {
           /* start playing when half of hwbuffer is filled */
           if (count == startcount)  snd_pcm_start(pcm_handle);
 
-          frames = olen;
-          if (off > 1.0) {
-              frames++;
-              off -= 1.0;
-          }
+          frames = pace_size(&pc);
+          want = frames;
           avail = snd_pcm_avail_update(pcm_handle);
           err = snd_pcm_mmap_begin(pcm_handle, &areas, &offset, &frames);
           if (err < 0) {
               fprintf(stderr, "playhrt: Don't get mmap address.\n");
               exit(21);
           }
+          /* at the end of the hwbuffer we get fewer frames, the rest is
+             written in the next loops */
+          if (frames < want && avail >= (snd_pcm_sframes_t)want)
+              pace_owe(&pc, want - frames);
 
           /* do some statistics to check average hwbuffer space available
              to check and improve --extra-bytes-per-second parameter */
@@ -776,27 +1785,26 @@ int main(int argc, char *argv[])
               avgav += avail;
               if (sumavg == 1) {
                   if (verbose > 1)
-                      fprintf(stderr, "playhrt: Average available buffer: %ld (%ld sec %ld nsec).\n", avgav/16, mtime.tv_sec, mtime.tv_nsec);
+                      fprintf(stderr, "playhrt: Average available buffer: %ld (%ld sec %ld nsec).\n", avgav/16, pc.next.tv_sec, pc.next.tv_nsec);
                   if (checktime == 0.0 && count > startcount+30000) {
-                       checktime = 1.0*mtime.tv_sec + mtime.tv_nsec/1000000000.0;
+                       checktime = 1.0*pc.next.tv_sec + pc.next.tv_nsec/1000000000.0;
                        checkav = avgav/16;
                        corr = 1;
                   }
                   if (corr && avgav/16 > checkav + hwbufsize*3/10) {
-                       extrabps += (double)((avgav/16-checkav)*bytesperframe)/(mtime.tv_sec*1.0+mtime.tv_nsec/1000000000.0-checktime);
-                       extraerr = 1.0*bytesperframe*rate;
-                       extraerr = extraerr/(extraerr+extrabps);
-                       nsec = (int) (1000000000*extraerr/loopspersec);
+                       extrabps += (double)((avgav/16-checkav)*bytesperframe)/(pc.next.tv_sec*1.0+pc.next.tv_nsec/1000000000.0-checktime);
+                       /* with --clock-sync the speed is that of the master */
+                       if (clk == NULL)
+                           pace_extra(&pc, extrabps/bytesperframe);
                        corr = 0;
                        fprintf(stderr, "playhrt: Avoiding buffer underrun! Please use option \n"
                                "      --extra-bytes-per-second=%d\n"
                                "on next call.\n", (int)extrabps);
                   }
                   if (corr && avgav/16 < checkav - hwbufsize*3/10) {
-                       extrabps += (double)((avgav/16-checkav)*bytesperframe)/(mtime.tv_sec*1.0+mtime.tv_nsec/1000000000.0-checktime);
-                       extraerr = 1.0*bytesperframe*rate;
-                       extraerr = extraerr/(extraerr+extrabps);
-                       nsec = (int) (1000000000*extraerr/loopspersec);
+                       extrabps += (double)((avgav/16-checkav)*bytesperframe)/(pc.next.tv_sec*1.0+pc.next.tv_nsec/1000000000.0-checktime);
+                       if (clk == NULL)
+                           pace_extra(&pc, extrabps/bytesperframe);
                        corr = 0;
                        fprintf(stderr, "playhrt: Avoiding buffer overrun! Please use option \n"
                                "      --extra-bytes-per-second=%d\n"
@@ -810,32 +1818,28 @@ int main(int argc, char *argv[])
           iptr = areas[0].addr + offset * bytesperframe;
           /*memclean(iptr, ilen);  commented out to save some CPU-time */
           /* in --mmap mode we read directly into mmaped space without internal buffer */
-          s = read(sfd, iptr, ilen);
+          if (clk != NULL)
+              s = syncread(sfd, iptr, ilen, bytesperframe);
+          else
+              s = getinput(sfd, iptr, ilen);
 
           /* compute time for next wakeup */
-          mtime.tv_nsec += nsec;
-          if (mtime.tv_nsec > 999999999) {
-            mtime.tv_nsec -= 1000000000;
-            mtime.tv_sec++;
-          }
-
+          pace_step(&pc);
 
           /* we refresh the new data before and directly after the  sleep before commiting */
           refreshmem(iptr, s);
 
-          /* debug:  check that we really sleep to some time in the future */
-          if (countdelay) {
-            clock_gettime(CLOCK_MONOTONIC, &mtimecheck);
-            if (mtimecheck.tv_sec > mtime.tv_sec || (mtimecheck.tv_sec == mtime.tv_sec && mtimecheck.tv_nsec > mtime.tv_nsec))
-                nrdelays += 1;
-          }
-          if (verbose > 1 && nrdelays > 0 && count % 4096 == 0) {
-              fprintf(stderr, "playhrt: Number of delayed loops: %ld (%ld sec %ld nsec).\n", nrdelays, mtime.tv_sec, mtime.tv_nsec);
+          if (verbose > 1 && pc.delayed > 0 && count % 4096 == 0) {
+              fprintf(stderr, "playhrt: Number of delayed loops: %lld (%ld sec %ld nsec).\n", pc.delayed, pc.next.tv_sec, pc.next.tv_nsec);
           }
 
-          clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &mtime, NULL);
+          /* with --no-delay-stats this does not check that we really
+             sleep to some time in the future */
+          pace_sleep(&pc);
 	  refreshmem(iptr, s);
           snd_pcm_mmap_commit(pcm_handle, offset, frames);
+          if (s > 0)
+              pc.units += s/bytesperframe;
           if (s < 0) {
               fprintf(stderr, "playhrt: Read error.\n");
               exit(22);
@@ -843,7 +1847,7 @@ int main(int argc, char *argv[])
               badreads++;
               readmissing += (ilen-s);
               if (verbose)
-                  fprintf(stderr, "playhrt: Bad read, %ld bytes missing at %ld.%ld.\n", (ilen-s), mtime.tv_sec, mtime.tv_nsec);
+                  fprintf(stderr, "playhrt: Bad read, %ld bytes missing at %ld.%ld.\n", (ilen-s), pc.next.tv_sec, pc.next.tv_nsec);
               if (badreads >= maxbad) {
                   fprintf(stderr, "playhrt: Had %d bad reads . . . exiting.\n", maxbad);
                   break;
@@ -851,25 +1855,63 @@ int main(int argc, char *argv[])
           }
           icount += s;
           ocount += s;
+          if (clk != NULL && count % fbloops == 0)
+              syncplayout(pcm_handle, ocount, bytesperframe, rate, verbose);
+          if (mixelem != NULL)
+              updatevolume(count, frames);
+          if (ctl != NULL)
+              setlatency(pcm_handle, 0, rate, &pc.next, &latmin, &latmax);
+          if (feedback && count % fbloops == 0)
+              sendfeedback(sfd, pcm_handle, 0, bytesperframe, &pc.next);
+          if (record)
+              looprec_add(avail, s, frames*bytesperframe);
+          if (looprec_sig && looprec_check())
+              break;
+          if (ctl != NULL && ctl->seq != ctlseq &&
+              docontrol(bytesperframe, &extrabps, &pc,
+                        &verbose, &dobufstats, &record,
+                        recfile != NULL, count, icount, ocount, pc.delayed,
+                        badreads, badloops, avail))
+              break;
           if (s == 0) /* done */
               break;
       }
     }
     /* cleanup network connection and sound device */
-    close(sfd);
+    if (clk != NULL) {
+        if (verbose) {
+            clocksync_report(clk);
+            syncstats();
+        }
+        clocksync_close(clk);
+    }
+    if (mc != NULL)
+        mcast_close(mc);
+    else
+        close(sfd);
     snd_pcm_drain(pcm_handle);
     snd_pcm_close(pcm_handle);
     if (verbose) {
         if (corr) {
-            morebps = (double)((avgav/16-checkav)*bytesperframe)/(mtime.tv_sec*1.0+mtime.tv_nsec/1000000000.0-checktime);
+            morebps = (double)((avgav/16-checkav)*bytesperframe)/(pc.next.tv_sec*1.0+pc.next.tv_nsec/1000000000.0-checktime);
             if (morebps >= 1.0 || morebps <= -1.0)
                 fprintf(stderr, "playhrt: Suggesting option \n"
                              "      --extra-bytes-per-second=%d\n"
                              "on future calls.\n", (int)(extrabps+morebps));
         }
-        fprintf(stderr, "playhrt: Loops: %ld (%ld delayed), total bytes: %lld in %lld out. \n"
+        fprintf(stderr, "playhrt: Loops: %ld (%lld delayed), total bytes: %lld in %lld out. \n"
                         "playhrt: Bad loops/frames written: %ld/%lld,  bad reads/bytes: %ld/%ld.\n",
-                    count, nrdelays, icount, ocount, badloops, badframes, badreads, readmissing);
+                    count, pc.delayed, icount, ocount, badloops, badframes, badreads, readmissing);
+        if (access == SND_PCM_ACCESS_RW_INTERLEAVED)
+            fprintf(stderr, "playhrt: Reads in loop: %lld.\n", nreads);
+        if (framed)
+            framestats();
+        if (rxstamp)
+            tstamp_report(&rxts);
+        if (ctl != NULL && latmax > 0)
+            fprintf(stderr, "playhrt: Output latency: %.3f to %.3f msec.\n",
+                    latmin/1000000.0, latmax/1000000.0);
+        pace_report(&pc);
     }
     return 0;
 }
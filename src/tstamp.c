@@ -0,0 +1,219 @@
+/*
+tstamp.c                Copyright frankl 2017
+
+This file is part of frankl's stereo utilities.
+See the file License.txt of the distribution and
+http://www.gnu.org/licenses/gpl.txt for license details.
+
+Kernel timestamps of network sockets, see tstamp.h.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <linux/errqueue.h>
+#include <linux/net_tstamp.h>
+#include "hist.h"
+#include "tstamp.h"
+
+void tstamp_init(struct tstamp *ts, char *prog)
+{
+    memset(ts, 0, sizeof(struct tstamp));
+    ts->prog = prog;
+    ts->fd = -1;
+    hist_init(&ts->delay);
+    hist_init(&ts->jitter);
+}
+
+long long tstamp_now()
+{
+    struct timespec t;
+
+    clock_gettime(CLOCK_REALTIME, &t);
+    return t.tv_sec*1000000000LL + t.tv_nsec;
+}
+
+static void tstamp_enable(struct tstamp *ts, int fd, int flags)
+{
+    if (setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPING, &flags,
+                   sizeof(int)) == -1) {
+        fprintf(stderr, "%s: Cannot use SO_TIMESTAMPING: %s.\n", ts->prog,
+                strerror(errno));
+        exit(95);
+    }
+    ts->fd = fd;
+    ts->havelast = 0;
+}
+
+/* the first kernel timestamp in the control messages, 0 if none */
+static long long tstamp_cmsg(struct msghdr *msg)
+{
+    struct cmsghdr *cm;
+    struct timespec *t;
+
+    for (cm = CMSG_FIRSTHDR(msg); cm != NULL; cm = CMSG_NXTHDR(msg, cm)) {
+        if (cm->cmsg_level != SOL_SOCKET || cm->cmsg_type != SO_TIMESTAMPING)
+            continue;
+        /* software, (deprecated), hardware */
+        t = (struct timespec*)CMSG_DATA(cm);
+        return t->tv_sec*1000000000LL + t->tv_nsec;
+    }
+    return 0;
+}
+
+static void tstamp_add(struct tstamp *ts, long long delay)
+{
+    hist_add(&ts->delay, delay);
+    if (ts->havelast)
+        hist_add(&ts->jitter, delay > ts->last ? delay - ts->last :
+                                                 ts->last - delay);
+    ts->last = delay;
+    ts->havelast = 1;
+}
+
+/* TX: a new socket, keys count from 0 */
+void tstamp_tx(struct tstamp *ts, int fd)
+{
+    tstamp_enable(ts, fd, SOF_TIMESTAMPING_TX_SOFTWARE |
+                          SOF_TIMESTAMPING_SOFTWARE |
+                          SOF_TIMESTAMPING_OPT_ID |
+                          SOF_TIMESTAMPING_OPT_TSONLY);
+    ts->unmatched += ts->head - ts->tail;
+    ts->head = ts->tail = 0;
+    ts->count = 0;
+}
+
+/* a write call at time t0 (tstamp_now) has written n bytes or datagrams */
+void tstamp_sent(struct tstamp *ts, long long t0, long long n)
+{
+    if (n <= 0)
+        return;
+    ts->count += n;
+    if (ts->head - ts->tail == TSTAMP_RING) {
+        ts->tail++;
+        ts->unmatched++;
+    }
+    ts->key[ts->head % TSTAMP_RING] = ts->count - 1;
+    ts->wtime[ts->head % TSTAMP_RING] = t0;
+    ts->head++;
+    ts->writes++;
+}
+
+/* a message from the error queue, returns 1 if it is a timestamp (the
+   caller may read the error queue for other reasons, too) */
+int tstamp_errmsg(struct tstamp *ts, struct msghdr *msg)
+{
+    struct cmsghdr *cm;
+    struct sock_extended_err *serr = NULL;
+    unsigned int k;
+    long long tx;
+
+    for (cm = CMSG_FIRSTHDR(msg); cm != NULL; cm = CMSG_NXTHDR(msg, cm))
+        if ((cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) ||
+            (cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR))
+            serr = (struct sock_extended_err*)CMSG_DATA(cm);
+    if (serr == NULL || serr->ee_origin != SO_EE_ORIGIN_TIMESTAMPING)
+        return 0;
+    if (serr->ee_info != SCM_TSTAMP_SND || (tx = tstamp_cmsg(msg)) == 0)
+        return 1;
+    ts->stamps++;
+    /* writes whose last byte got no timestamp (e.g., with TCP their
+       last byte was sent together with the next write) */
+    k = serr->ee_data;
+    while (ts->tail < ts->head &&
+           (int)(ts->key[ts->tail % TSTAMP_RING] - k) < 0) {
+        ts->tail++;
+        ts->unmatched++;
+    }
+    if (ts->tail == ts->head)
+        return 1;
+    tstamp_add(ts, tx - ts->wtime[ts->tail % TSTAMP_RING]);
+    /* several datagrams of a write have their own timestamps */
+    if (ts->key[ts->tail % TSTAMP_RING] == k)
+        ts->tail++;
+    return 1;
+}
+
+/* read the timestamps which are ready */
+void tstamp_reap(struct tstamp *ts)
+{
+    char control[256];
+    struct msghdr msg;
+
+    while (1) {
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        if (recvmsg(ts->fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) == -1)
+            return;
+        tstamp_errmsg(ts, &msg);
+    }
+}
+
+/* RX: stream of bytespersec bytes, each datagram has hdr bytes more */
+void tstamp_rx(struct tstamp *ts, int fd, double bytespersec, int hdr)
+{
+    tstamp_enable(ts, fd, SOF_TIMESTAMPING_RX_SOFTWARE |
+                          SOF_TIMESTAMPING_SOFTWARE);
+    ts->bytespersec = bytespersec;
+    ts->hdr = hdr;
+}
+
+/* like recv, with TCP the timestamp is that of the last packet read */
+ssize_t tstamp_recv(struct tstamp *ts, int fd, void *buf, size_t len,
+                    int flags)
+{
+    char control[256];
+    struct msghdr msg;
+    struct iovec iov;
+    long long now, rx;
+    ssize_t s;
+
+    iov.iov_base = buf;
+    iov.iov_len = len;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    s = recvmsg(fd, &msg, flags);
+    if (s <= ts->hdr)
+        return s;
+    now = tstamp_now();
+    ts->bytes += s - ts->hdr;
+    if ((rx = tstamp_cmsg(&msg)) == 0)
+        return s;
+    ts->stamps++;
+    hist_add(&ts->delay, now - rx);
+    /* arrival interval against the nominal time of the bytes between */
+    if (ts->havelast)
+        hist_add(&ts->jitter, llabs(rx - ts->lastrx -
+                 (long long)((ts->bytes - ts->lastbytes)*1e9/
+                             ts->bytespersec)));
+    ts->lastrx = rx;
+    ts->lastbytes = ts->bytes;
+    ts->havelast = 1;
+    return s;
+}
+
+void tstamp_report(struct tstamp *ts)
+{
+    if (ts->bytespersec > 0.0) {
+        fprintf(stderr, "%s: RX timestamps: %lld (%lld bytes).\n", ts->prog,
+                ts->stamps, ts->bytes);
+        hist_print(ts->prog, "Driver to read call (RX)", &ts->delay);
+        hist_print(ts->prog, "Arrival jitter (RX)", &ts->jitter);
+        return;
+    }
+    fprintf(stderr, "%s: TX timestamps: %lld for %lld writes, %lld writes "
+                    "without timestamp.\n", ts->prog, ts->stamps, ts->writes,
+            ts->unmatched + ts->head - ts->tail);
+    hist_print(ts->prog, "Write call to driver (TX)", &ts->delay);
+    hist_print(ts->prog, "Jitter of this time (TX)", &ts->jitter);
+}
@@ -0,0 +1,65 @@
+/*
+tstamp.h                Copyright frankl 2017
+
+This file is part of frankl's stereo utilities.
+See the file License.txt of the distribution and
+http://www.gnu.org/licenses/gpl.txt for license details.
+
+Kernel timestamps of network sockets (SO_TIMESTAMPING, options
+--tx-timestamps of 'bufhrt' and --rx-timestamps of 'playhrt'), to see
+when the data really leave and arrive, not only when a write or read
+call returns.
+
+TX: the kernel reports (on the error queue of the socket) the time when
+a packet is handed to the network driver. With SOF_TIMESTAMPING_OPT_ID
+each report has a key: the number of the byte (TCP) or the datagram
+(UDP) counted from the start. The caller registers each write with the
+time before the call and the number of bytes or datagrams written
+(tstamp_sent), so the report of the last byte or datagram of a write
+belongs to it. Histograms: time from the write call to the driver, and
+its change from one report to the next (the jitter the network stack
+adds to the timed loop).
+
+RX: tstamp_recv is used instead of recv, it gets the time when a packet
+came in from the driver. Histograms: time until the data are read, and
+the deviation of the arrival times from the nominal rate of the stream
+(the change of the arrival interval against the bytes in between).
+
+The kernel timestamps are CLOCK_REALTIME, so are the other times here.
+Include hist.h before this file.
+*/
+
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#define TSTAMP_RING 1024
+
+struct tstamp {
+    char *prog;
+    int fd;
+    /* TX: keys (last byte or datagram) and times of the writes */
+    unsigned int count;
+    unsigned int key[TSTAMP_RING];
+    long long wtime[TSTAMP_RING];
+    long long head, tail;
+    long long writes, stamps, unmatched;
+    /* RX: nominal rate and bytes of a header per datagram */
+    double bytespersec;
+    int hdr;
+    long long bytes, lastbytes, lastrx;
+    /* last value, for the jitter */
+    long long last;
+    int havelast;
+    struct hist delay, jitter;
+};
+
+void tstamp_init(struct tstamp *ts, char *prog);
+long long tstamp_now();
+void tstamp_tx(struct tstamp *ts, int fd);
+void tstamp_sent(struct tstamp *ts, long long t0, long long n);
+int tstamp_errmsg(struct tstamp *ts, struct msghdr *msg);
+void tstamp_reap(struct tstamp *ts);
+void tstamp_rx(struct tstamp *ts, int fd, double bytespersec, int hdr);
+ssize_t tstamp_recv(struct tstamp *ts, int fd, void *buf, size_t len,
+                    int flags);
+void tstamp_report(struct tstamp *ts);
@@ -0,0 +1,336 @@
+/*
+uring.c                Copyright frankl 2017
+
+This file is part of frankl's stereo utilities.
+See the file License.txt of the distribution and
+http://www.gnu.org/licenses/gpl.txt for license details.
+
+Reading or writing a regular file with io_uring, see uring.h.
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include "uring.h"
+
+/* requests are sent to the kernel in uring_read and uring_write, and
+   with wait != 0 we wait for at least one completion */
+static void uring_enter(struct uring *u, int wait) {
+  int s;
+
+  do {
+     s = syscall(__NR_io_uring_enter, u->ringfd, u->tosubmit, wait ? 1 : 0,
+                 wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+  } while (s < 0 && errno == EINTR);
+  if (s < 0) {
+     fprintf(stderr, "%s: Cannot submit to io_uring: %s.\n", u->prog,
+             strerror(errno));
+     exit(61);
+  }
+  u->tosubmit -= s;
+}
+
+static void uring_submit(struct uring *u, int k) {
+  struct io_uring_sqe *sqe;
+  unsigned tail, idx;
+
+  tail = *u->sqtail;
+  idx = tail & *u->sqmask;
+  sqe = (struct io_uring_sqe*)u->sqes + idx;
+  memset(sqe, 0, sizeof(struct io_uring_sqe));
+  if (u->fixed) {
+     sqe->opcode = u->write ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+     sqe->buf_index = k;
+  } else
+     sqe->opcode = u->write ? IORING_OP_WRITE : IORING_OP_READ;
+  sqe->fd = u->fd;
+  sqe->off = u->bl[k].off;
+  sqe->addr = (unsigned long)u->bl[k].buf;
+  sqe->len = u->write ? u->bl[k].len : u->bsize;
+  sqe->user_data = k;
+  u->sqarray[idx] = idx;
+  __atomic_store_n(u->sqtail, tail+1, __ATOMIC_RELEASE);
+  u->bl[k].state = UB_BUSY;
+  u->tosubmit++;
+  u->requests++;
+}
+
+/* handle completions, this needs no system call */
+static void uring_reap(struct uring *u) {
+  struct io_uring_cqe *cqe;
+  struct ublock *b;
+  unsigned head;
+
+  head = *u->cqhead;
+  while (head != __atomic_load_n(u->cqtail, __ATOMIC_ACQUIRE)) {
+     cqe = (struct io_uring_cqe*)u->cqes + (head & *u->cqmask);
+     b = u->bl + cqe->user_data;
+     if (cqe->res < 0) {
+        fprintf(stderr, "%s: %s error at offset %lld (io_uring): %s.\n",
+                u->prog, u->write ? "Write" : "Read", b->off,
+                strerror(-cqe->res));
+        exit(62);
+     }
+     if (u->write) {
+        if (cqe->res != b->len) {
+           fprintf(stderr, "%s: Short write at offset %lld (io_uring).\n",
+                   u->prog, b->off);
+           exit(62);
+        }
+        b->state = UB_FREE;
+     } else {
+        b->len = cqe->res;
+        b->state = UB_DONE;
+     }
+     head++;
+  }
+  __atomic_store_n(u->cqhead, head, __ATOMIC_RELEASE);
+}
+
+/* wait until no request is in flight */
+static void uring_drain(struct uring *u) {
+  int k;
+
+  uring_reap(u);
+  for (k = 0; k < u->depth; k++) {
+     while (u->bl[k].state == UB_BUSY) {
+        uring_enter(u, 1);
+        uring_reap(u);
+     }
+  }
+}
+
+/* the blocks have at least the size of chunks used in the loop (and at
+   least 64kB), reads are started here, with prealloc > 0 the space of
+   an output file is allocated in advance */
+struct uring *uring_open(char *prog, int fd, int write, int depth, long chunk,
+                         long long prealloc, int verbose) {
+  struct uring *u;
+  struct io_uring_params p;
+  struct iovec *iov;
+  struct stat sb;
+  char *sq, *cq;
+  size_t sqsz, cqsz;
+  int k, fl;
+
+  if (! (u = calloc(1, sizeof(struct uring))) ||
+      ! (u->bl = calloc(depth, sizeof(struct ublock))) ||
+      ! (iov = calloc(depth, sizeof(struct iovec))) ) {
+     fprintf(stderr, "%s: Cannot allocate io_uring blocks.\n", prog);
+     exit(60);
+  }
+  u->prog = prog;
+  u->fd = fd;
+  u->write = write;
+  u->depth = depth;
+  u->verbose = verbose;
+  if (chunk < 65536)
+     chunk = 65536;
+  u->bsize = (chunk + 4095) & ~4095L;
+
+  memset(&p, 0, sizeof(p));
+  if ((u->ringfd = syscall(__NR_io_uring_setup, depth, &p)) < 0) {
+     fprintf(stderr, "%s: Cannot create io_uring: %s.\n", prog,
+             strerror(errno));
+     exit(60);
+  }
+  sqsz = p.sq_off.array + p.sq_entries*sizeof(unsigned);
+  cqsz = p.cq_off.cqes + p.cq_entries*sizeof(struct io_uring_cqe);
+  if ((p.features & IORING_FEAT_SINGLE_MMAP) && cqsz > sqsz)
+     sqsz = cqsz;
+  sq = mmap(NULL, sqsz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+            u->ringfd, IORING_OFF_SQ_RING);
+  if (p.features & IORING_FEAT_SINGLE_MMAP)
+     cq = sq;
+  else
+     cq = mmap(NULL, cqsz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+               u->ringfd, IORING_OFF_CQ_RING);
+  u->sqes = mmap(NULL, p.sq_entries*sizeof(struct io_uring_sqe),
+                 PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                 u->ringfd, IORING_OFF_SQES);
+  if (sq == MAP_FAILED || cq == MAP_FAILED || u->sqes == MAP_FAILED) {
+     fprintf(stderr, "%s: Cannot map io_uring: %s.\n", prog, strerror(errno));
+     exit(60);
+  }
+  u->sqhead = (unsigned*)(sq + p.sq_off.head);
+  u->sqtail = (unsigned*)(sq + p.sq_off.tail);
+  u->sqmask = (unsigned*)(sq + p.sq_off.ring_mask);
+  u->sqarray = (unsigned*)(sq + p.sq_off.array);
+  u->cqhead = (unsigned*)(cq + p.cq_off.head);
+  u->cqtail = (unsigned*)(cq + p.cq_off.tail);
+  u->cqmask = (unsigned*)(cq + p.cq_off.ring_mask);
+  u->cqes = cq + p.cq_off.cqes;
+
+  /* aligned blocks, touched and locked here */
+  for (k = 0; k < depth; k++) {
+     if (posix_memalign((void**)&u->bl[k].buf, 4096, u->bsize) != 0) {
+        fprintf(stderr, "%s: Cannot allocate io_uring blocks.\n", prog);
+        exit(60);
+     }
+     memset(u->bl[k].buf, 0, u->bsize);
+     mlock(u->bl[k].buf, u->bsize);
+     iov[k].iov_base = u->bl[k].buf;
+     iov[k].iov_len = u->bsize;
+  }
+  u->fixed = (syscall(__NR_io_uring_register, u->ringfd,
+                      IORING_REGISTER_BUFFERS, iov, depth) == 0);
+  free(iov);
+  /* not all file systems support O_DIRECT */
+  fl = fcntl(fd, F_GETFL);
+  u->direct = (fl != -1 && fcntl(fd, F_SETFL, fl | O_DIRECT) == 0);
+  if (write && prealloc > 0 && fallocate(fd, 0, 0, prealloc) == -1 && verbose)
+     fprintf(stderr, "%s: Cannot preallocate %lld bytes: %s.\n", prog,
+             prealloc, strerror(errno));
+  if (verbose)
+     fprintf(stderr, "%s: io_uring %s %d blocks of %ld bytes, %s, %s.\n",
+             prog, write ? "writing" : "reading", depth, u->bsize,
+             u->fixed ? "registered buffers" : "normal buffers",
+             u->direct ? "O_DIRECT" : "page cache");
+
+  if (!write) {
+     if (fstat(fd, &sb) == -1)
+        sb.st_size = 0;
+     u->size = sb.st_size;
+     for (k = 0; k < depth && u->next < u->size; k++) {
+        u->bl[k].off = u->next;
+        u->next += u->bsize;
+        uring_submit(u, k);
+     }
+     if (u->tosubmit)
+        uring_enter(u, 0);
+  }
+  return u;
+}
+
+/* copy up to len bytes of the input to ptr, and request the next block
+   whenever one is used up; returns 0 at the end of the file, and without
+   wait -1 with errno EAGAIN if no data have arrived yet */
+ssize_t uring_read(struct uring *u, void *ptr, size_t len, int wait) {
+  struct ublock *b;
+  size_t got, n;
+
+  for (got = 0; got < len && !u->eof; ) {
+     uring_reap(u);
+     b = u->bl + u->head;
+     if (b->state == UB_FREE) {
+        u->eof = 1;
+        break;
+     }
+     if (b->state == UB_BUSY) {
+        if (got > 0 || !wait)
+           break;
+        uring_enter(u, 1);
+        u->waits++;
+        continue;
+     }
+     n = b->len - u->pos;
+     if (n > len - got)
+        n = len - got;
+     memcpy((char*)ptr + got, b->buf + u->pos, n);
+     got += n;
+     u->pos += n;
+     if (u->pos < b->len)
+        continue;
+     if (b->off + b->len >= u->size || b->len == 0) {
+        u->eof = 1;
+        break;
+     }
+     if (b->len < u->bsize) {
+        fprintf(stderr, "%s: Short read at offset %lld (io_uring).\n",
+                u->prog, b->off);
+        exit(62);
+     }
+     /* block used up, reuse it for the next request */
+     if (u->next < u->size) {
+        b->off = u->next;
+        u->next += u->bsize;
+        uring_submit(u, u->head);
+     } else
+        b->state = UB_FREE;
+     u->head = (u->head + 1) % u->depth;
+     u->pos = 0;
+  }
+  if (u->tosubmit)
+     uring_enter(u, 0);
+  if (got == 0 && !u->eof) {
+     errno = EAGAIN;
+     return -1;
+  }
+  return got;
+}
+
+/* copy len bytes from ptr to the current block and submit it when it
+   is full; we only wait if all blocks are still in flight */
+ssize_t uring_write(struct uring *u, void *ptr, size_t len) {
+  struct ublock *b;
+  size_t done, n;
+
+  uring_reap(u);
+  for (done = 0; done < len; ) {
+     b = u->bl + u->head;
+     if (b->state == UB_BUSY)
+        u->waits++;
+     while (b->state == UB_BUSY) {
+        uring_enter(u, 1);
+        uring_reap(u);
+     }
+     n = u->bsize - u->pos;
+     if (n > len - done)
+        n = len - done;
+     memcpy(b->buf + u->pos, (char*)ptr + done, n);
+     done += n;
+     u->pos += n;
+     if (u->pos == u->bsize) {
+        b->len = u->bsize;
+        b->off = u->next;
+        u->next += u->bsize;
+        uring_submit(u, u->head);
+        u->head = (u->head + 1) % u->depth;
+        u->pos = 0;
+     }
+  }
+  if (u->tosubmit)
+     uring_enter(u, 0);
+  return len;
+}
+
+/* wait for requests in flight, an output file gets its last partial
+   block (not aligned, so without O_DIRECT) and its final length */
+void uring_close(struct uring *u) {
+  struct ublock *b;
+  int k;
+
+  uring_drain(u);
+  if (u->write && u->pos > 0) {
+     if (u->direct)
+        fcntl(u->fd, F_SETFL, fcntl(u->fd, F_GETFL) & ~O_DIRECT);
+     b = u->bl + u->head;
+     b->len = u->pos;
+     b->off = u->next;
+     u->next += u->pos;
+     uring_submit(u, u->head);
+     uring_enter(u, 0);
+     uring_drain(u);
+  }
+  if (u->write && ftruncate(u->fd, u->next) == -1)
+     fprintf(stderr, "%s: Cannot set length of output file: %s.\n", u->prog,
+             strerror(errno));
+  if (u->verbose)
+     fprintf(stderr, "%s: io_uring %s %lld requests, waited %lld times.\n",
+             u->prog, u->write ? "wrote" : "read", u->requests, u->waits);
+  close(u->ringfd);
+  for (k = 0; k < u->depth; k++)
+     free(u->bl[k].buf);
+  free(u->bl);
+  free(u);
+}
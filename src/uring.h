@@ -0,0 +1,58 @@
+/*
+uring.h                Copyright frankl 2017
+
+This file is part of frankl's stereo utilities.
+See the file License.txt of the distribution and
+http://www.gnu.org/licenses/gpl.txt for license details.
+
+Reading or writing a regular file with io_uring (option --io-uring of
+'bufhrt'): a fixed number of blocks is kept in flight, the timed loop
+only copies data from or to completed blocks and submits new requests,
+it does not wait for the disk. We use the system calls directly, so
+liburing is not needed (Linux 5.6 or newer).
+
+The blocks are aligned and registered with the kernel, if possible, and
+the file is switched to O_DIRECT if the file system supports this.
+*/
+
+#include <sys/types.h>
+
+struct ublock {
+    char *buf;
+    long len;          /* bytes to write, or bytes read */
+    long long off;     /* file offset */
+    int state;         /* UB_FREE, UB_BUSY or UB_DONE */
+};
+
+#define UB_FREE 0
+#define UB_BUSY 1
+#define UB_DONE 2
+
+struct uring {
+    char *prog;
+    int fd, ringfd;
+    int write;         /* file is written, not read */
+    int depth;         /* number of blocks */
+    long bsize;        /* size of blocks */
+    int direct;        /* file uses O_DIRECT */
+    int fixed;         /* buffers are registered */
+    int verbose;
+    struct ublock *bl;
+    int head;          /* block to copy from or to next */
+    long pos;          /* position in this block */
+    long long next;    /* file offset of next request */
+    long long size;    /* size of input file */
+    int eof;
+    int tosubmit;
+    long long requests, waits;
+    /* the mapped rings */
+    unsigned *sqhead, *sqtail, *sqmask, *sqarray;
+    unsigned *cqhead, *cqtail, *cqmask;
+    void *sqes, *cqes;
+};
+
+struct uring *uring_open(char *prog, int fd, int write, int depth, long chunk,
+                         long long prealloc, int verbose);
+ssize_t uring_read(struct uring *u, void *ptr, size_t len, int wait);
+ssize_t uring_write(struct uring *u, void *ptr, size_t len);
+void uring_close(struct uring *u);
@@ -236,7 +236,7 @@ int main(int argc, char *argv[])
        } else
            unlink(fnames[i-optind]);
 
-       tmpnames[i-optind] = (char*)malloc(strlen(argv[i])+5);
+       tmpnames[i-optind] = (char*)calloc(strlen(argv[i])+5, 1);
        strncpy(tmpnames[i-optind], fnames[i-optind], strlen(argv[i]));
        strncat(tmpnames[i-optind], ".TMP", 4);
        if (shared) {